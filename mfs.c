@@ -5,12 +5,84 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include "mfs.h"
 #include "udp.h"
 #include "struct.h"
 
-char *s_host = NULL;
-int s_port = -1;
+// one socket and one resolved server address for the life of the client
+int s_sd = -1;
+struct sockaddr_in s_addr;
+int s_seq = 0; // sequence number of the last request sent
+pid_t s_pid = -1; // process the socket was opened by
+
+// retransmission timer after Jacobson/Karels, in usec. Only replies to
+// requests sent once are sampled (Karn), a backed off RTO sticks until then.
+#define RTO_MIN (10000)
+#define RTO_MAX (8000000)
+#define RTO_INIT (1000000)
+#define RPC_TRIES (10) // transmissions before a request fails
+
+int s_rtt_valid = 0;
+long s_srtt = 0, s_rttvar = 0, s_rto = RTO_INIT;
+MFS_RpcStats_t s_stats;
+char s_rx[MFS_RANGE_MAX * MFS_WIRE_MAX]; // a burst of replies
+#define RPC_RCVBUF (MFS_RANGE_MAX * MFS_WIRE_MAX * 4) // a READV burst must not overflow the socket
+
+// block cache, off until MFS_CacheInit: blocks MFS_Read fetched under a
+// lease are answered from here until it runs out, counted from when the
+// request was sent so it never outlives the server's. Every slot is on
+// the LRU list, free ones at the tail, and chained by hash of its block.
+#define BCACHE_LEASE (1000000) // usec of lease asked for, the server may grant less
+
+typedef struct __bcache_ent_t
+{
+  int inum; // -1 marks a free slot
+  int block;
+  long expires; // rpc_now_usec() when the lease runs out
+  int prev;  // towards most recently used
+  int next;  // towards least recently used
+  int chain; // next slot in the hash bucket
+  int ahead; // read ahead and not asked for yet
+  char data[MFS_BLOCK_SIZE];
+} bcache_ent_t;
+
+bcache_ent_t *s_bc = NULL;
+int *s_bc_hash = NULL; // bucket -> first slot, -1 when empty
+int s_bc_size = 0;
+int s_bc_head = -1, s_bc_tail = -1;
+
+// readahead, off until MFS_ReadAhead: an MFS_Read that misses the cache on
+// the block after the last one read of the same inode asks for up to
+// s_ra_window blocks more in a READV, which land in the cache
+int s_ra_window = 0;
+int s_ra_inum = -1, s_ra_next = -1;
+int s_ra_unleased = -1; // the inode's blocks came back without a lease, so
+                        // are not read ahead until a READ gets one again
+
+// attribute cache, off until MFS_AttrCacheInit: MFS_Lookup results keyed
+// by (pinum, name), -1 for a name that was not there, and MFS_Stat results
+// keyed by inum, each trusted for s_ac_ttl usec. Direct mapped, a collision
+// evicts the older entry. Our own changes drop what they make stale.
+typedef struct __name_ent_t
+{
+  int pinum; // -1 marks an empty slot
+  char name[28];
+  int inum;
+  long expires;
+} name_ent_t;
+
+typedef struct __attr_ent_t
+{
+  int inum; // -1 marks an empty slot
+  MFS_Stat_t stat;
+  long expires;
+} attr_ent_t;
+
+name_ent_t *s_ac_names = NULL;
+attr_ent_t *s_ac_attrs = NULL;
+int s_ac_size = 0;
+long s_ac_ttl = 0;
 
 int name_checker(char* name){
 	if (name == NULL){
@@ -23,43 +95,515 @@ int name_checker(char* name){
 	return 0;
 }
 
-int Sd_Msg(MFS_MSG_t *send, MFS_MSG_t *receive, char *host, int port)
+long rpc_now_usec()
 {
-  int sd = UDP_Open(0);
-  struct sockaddr_in addrSnd, addrRcv;
-  int rc = UDP_FillSockAddr(&addrSnd, host, port);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int acache_name_slot(int pinum, char *name)
+{
+  unsigned int h = 2166136261u;
+  h = (h ^ (unsigned int)pinum) * 16777619u;
+  for (int i = 0; i < 28 && name[i] != '\0'; i++)
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h % s_ac_size;
+}
+
+// the cached lookup of name in pinum, NULL if there is none still good
+name_ent_t *acache_name_find(int pinum, char *name)
+{
+  if (s_ac_size == 0)
+    return NULL;
+  name_ent_t *e = &s_ac_names[acache_name_slot(pinum, name)];
+  if (e->pinum != pinum || strncmp(e->name, name, 28) != 0 || e->expires <= rpc_now_usec())
+    return NULL;
+  return e;
+}
+
+int acache_name_set(int pinum, char *name, int inum)
+{
+  if (s_ac_size == 0)
+    return 0;
+  name_ent_t *e = &s_ac_names[acache_name_slot(pinum, name)];
+  e->pinum = pinum;
+  memset(e->name, 0, 28);
+  memcpy(e->name, name, strnlen(name, 28));
+  e->inum = inum;
+  e->expires = rpc_now_usec() + s_ac_ttl;
+  return 0;
+}
+
+int acache_name_drop(int pinum, char *name)
+{
+  if (s_ac_size == 0)
+    return 0;
+  name_ent_t *e = &s_ac_names[acache_name_slot(pinum, name)];
+  if (e->pinum == pinum && strncmp(e->name, name, 28) == 0)
+    e->pinum = -1;
+  return 0;
+}
+
+attr_ent_t *acache_attr_find(int inum)
+{
+  if (s_ac_size == 0 || inum < 0)
+    return NULL;
+  attr_ent_t *e = &s_ac_attrs[inum % s_ac_size];
+  if (e->inum != inum || e->expires <= rpc_now_usec())
+    return NULL;
+  return e;
+}
+
+int acache_attr_set(int inum, MFS_Stat_t *m)
+{
+  if (s_ac_size == 0 || inum < 0)
+    return 0;
+  attr_ent_t *e = &s_ac_attrs[inum % s_ac_size];
+  e->inum = inum;
+  e->stat = *m;
+  e->expires = rpc_now_usec() + s_ac_ttl;
+  return 0;
+}
+
+// inum -1 drops every attribute
+int acache_attr_drop(int inum)
+{
+  for (int i = 0; i < s_ac_size; i++)
+  {
+    if (inum == -1 || s_ac_attrs[i].inum == inum)
+      s_ac_attrs[i].inum = -1;
+  }
+  return 0;
+}
+
+int bcache_bucket(int inum, int block)
+{
+  return ((unsigned int)inum * 2654435761u ^ (unsigned int)block) % s_bc_size;
+}
+
+int bcache_find(int inum, int block)
+{
+  if (s_bc_size == 0)
+    return -1;
+  for (int i = s_bc_hash[bcache_bucket(inum, block)]; i != -1; i = s_bc[i].chain)
+  {
+    if (s_bc[i].inum == inum && s_bc[i].block == block)
+      return i;
+  }
+  return -1;
+}
+
+int bcache_lru_unlink(int i)
+{
+  if (s_bc[i].prev != -1)
+    s_bc[s_bc[i].prev].next = s_bc[i].next;
+  else
+    s_bc_head = s_bc[i].next;
+  if (s_bc[i].next != -1)
+    s_bc[s_bc[i].next].prev = s_bc[i].prev;
+  else
+    s_bc_tail = s_bc[i].prev;
+  return 0;
+}
+
+int bcache_lru_front(int i)
+{
+  s_bc[i].prev = -1;
+  s_bc[i].next = s_bc_head;
+  if (s_bc_head != -1)
+    s_bc[s_bc_head].prev = i;
+  s_bc_head = i;
+  if (s_bc_tail == -1)
+    s_bc_tail = i;
+  return 0;
+}
+
+// take slot i out of its hash bucket and put it at the tail as free
+int bcache_free(int i)
+{
+  if (s_bc[i].inum == -1)
+    return 0;
+  int *p = &s_bc_hash[bcache_bucket(s_bc[i].inum, s_bc[i].block)];
+  while (*p != i)
+    p = &s_bc[*p].chain;
+  *p = s_bc[i].chain;
+  s_bc[i].inum = -1;
+  if (s_bc[i].ahead)
+    s_stats.ahead_wasted++;
+
+  bcache_lru_unlink(i);
+  s_bc[i].next = -1;
+  s_bc[i].prev = s_bc_tail;
+  if (s_bc_tail != -1)
+    s_bc[s_bc_tail].next = i;
+  s_bc_tail = i;
+  if (s_bc_head == -1)
+    s_bc_head = i;
+  return 0;
+}
+
+int bcache_insert(int inum, int block, char *data, long expires, int ahead)
+{
+  if (s_bc_size == 0)
+    return 0;
+  int i = bcache_find(inum, block);
+  if (i != -1 && s_bc[i].ahead)
+    s_stats.ahead_wasted++;
+  if (i == -1)
+  {
+    i = s_bc_tail;
+    bcache_free(i);
+    s_bc[i].inum = inum;
+    s_bc[i].block = block;
+    int b = bcache_bucket(inum, block);
+    s_bc[i].chain = s_bc_hash[b];
+    s_bc_hash[b] = i;
+  }
+  memcpy(s_bc[i].data, data, MFS_BLOCK_SIZE);
+  s_bc[i].expires = expires;
+  s_bc[i].ahead = ahead;
+  bcache_lru_unlink(i);
+  bcache_lru_front(i);
+  return 0;
+}
+
+// forget blocks we are about to change; inum -1 forgets everything and
+// count -1 all of inum
+int bcache_drop(int inum, int block, int count)
+{
+  for (int i = 0; i < s_bc_size; i++)
+  {
+    if (s_bc[i].inum == -1 || (inum != -1 && s_bc[i].inum != inum))
+      continue;
+    if (count == -1 || (s_bc[i].block >= block && s_bc[i].block < block + count))
+      bcache_free(i);
+  }
+  return 0;
+}
+
+int rtt_sample(long rtt)
+{
+  if (!s_rtt_valid)
+  {
+    s_srtt = rtt;
+    s_rttvar = rtt / 2;
+    s_rtt_valid = 1;
+  }
+  else
+  {
+    long err = rtt - s_srtt;
+    s_srtt += err / 8;
+    s_rttvar += ((err < 0 ? -err : err) - s_rttvar) / 4;
+  }
+  s_rto = s_srtt + 4 * s_rttvar;
+  if (s_rto < RTO_MIN)
+    s_rto = RTO_MIN;
+  if (s_rto > RTO_MAX)
+    s_rto = RTO_MAX;
+  return 0;
+}
+
+// pack datagram part of a request into its wire form: the header and range
+// go in hdr and range, the three iovecs point at them and at the payload
+// where it lies. WRITEV has one part per block, everything else just part 0
+int msg_encode(MFS_MSG_t *msg, int part, MFS_WireHdr_t *hdr, MFS_WireRange_t *range, struct iovec *iov)
+{
+  hdr->magic = MFS_WIRE_MAGIC;
+  hdr->version = MFS_WIRE_VERSION;
+  hdr->req = msg->req;
+  hdr->seq = msg->seq;
+  hdr->inum = msg->req == SHUTDOWN ? 0 : msg->inum;
+  // only what the request carries goes out, the rest of msg may be
+  // whatever was on the caller's stack
+  hdr->arg = 0;
+  if (msg->req == READ || msg->req == WRITE || msg->req == READV || msg->req == WRITEV)
+    hdr->arg = msg->block + part;
+  else if (msg->req == CREAT)
+    hdr->arg = msg->stat.type;
+  hdr->len = 0;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(MFS_WireHdr_t);
+  // unused parts still go to the kernel, which faults on a stray base
+  iov[1].iov_base = NULL;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = NULL;
+  iov[2].iov_len = 0;
+  if (msg->req == LOOKUP || msg->req == CREAT || msg->req == UNLINK)
+  {
+    iov[1].iov_base = msg->name;
+    iov[1].iov_len = strnlen(msg->name, 28);
+  }
+  else if (msg->req == LOOKUP_PATH)
+  {
+    iov[1].iov_base = msg->buffer;
+    iov[1].iov_len = strnlen(msg->buffer, MFS_PATH_MAX);
+  }
+  else if (msg->req == WRITE)
+  {
+    iov[1].iov_base = msg->data;
+    iov[1].iov_len = MFS_BLOCK_SIZE;
+  }
+  else if (msg->req == READ && msg->lease > 0)
+  {
+    iov[1].iov_base = &msg->lease;
+    iov[1].iov_len = sizeof(int);
+  }
+  else if (msg->req == READV || msg->req == WRITEV)
+  {
+    range->first = msg->block;
+    range->count = msg->count;
+    iov[1].iov_base = range;
+    iov[1].iov_len = sizeof(MFS_WireRange_t);
+    if (msg->req == WRITEV)
+    {
+      iov[2].iov_base = msg->blocks + part * MFS_BLOCK_SIZE;
+      iov[2].iov_len = MFS_BLOCK_SIZE;
+    }
+    else if (msg->lease > 0)
+    {
+      iov[2].iov_base = &msg->lease;
+      iov[2].iov_len = sizeof(int);
+    }
+  }
+  hdr->len = iov[1].iov_len + iov[2].iov_len;
+  return 0;
+}
+
+// unpack a reply to send: -1 if the datagram is not one, 1 if more of a
+// READV range is still to come, 0 once the reply is complete. got has a bit
+// per block of the range that has arrived.
+int msg_decode_reply(char *buf, int n, MFS_MSG_t *send, MFS_MSG_t *receive, unsigned int *got)
+{
+  MFS_WireHdr_t hdr;
+  if (n < sizeof(MFS_WireHdr_t))
+    return -1;
+  memcpy(&hdr, buf, sizeof(MFS_WireHdr_t));
+  if (hdr.magic != MFS_WIRE_MAGIC || hdr.version != MFS_WIRE_VERSION || hdr.req != RESPONSE)
+    return -1;
+  if (hdr.seq != send->seq || hdr.len < 0 || hdr.len != n - sizeof(MFS_WireHdr_t))
+    return -1;
+
+  char *payload = buf + sizeof(MFS_WireHdr_t);
+  receive->req = RESPONSE;
+  receive->seq = hdr.seq;
+  receive->inum = hdr.inum;
+  receive->lease = 0;
+  receive->block = hdr.arg;
+  if (send->req == READ && hdr.inum >= 0)
+  {
+    if (hdr.len != MFS_BLOCK_SIZE)
+      return -1;
+    memcpy(receive->data, payload, MFS_BLOCK_SIZE);
+    receive->lease = hdr.arg;
+  }
+  else if ((send->req == STAT || send->req == LOOKUP_PATH) && hdr.inum >= 0)
+  {
+    if (hdr.len != sizeof(MFS_Stat_t))
+      return -1;
+    memcpy(&receive->stat, payload, sizeof(MFS_Stat_t));
+  }
+  else if (send->req == READV && hdr.inum >= 0)
+  {
+    MFS_WireRange_t range;
+    if (hdr.len == sizeof(MFS_WireRange_t) + MFS_BLOCK_SIZE + sizeof(int))
+      memcpy(&receive->lease, payload + sizeof(MFS_WireRange_t) + MFS_BLOCK_SIZE, sizeof(int));
+    else if (hdr.len != sizeof(MFS_WireRange_t) + MFS_BLOCK_SIZE)
+      return -1;
+    memcpy(&range, payload, sizeof(MFS_WireRange_t));
+    int part = hdr.arg - send->block;
+    if (range.first != send->block || range.count != send->count || part < 0 || part >= send->count)
+      return -1;
+    memcpy(receive->blocks + part * MFS_BLOCK_SIZE, payload + sizeof(MFS_WireRange_t), MFS_BLOCK_SIZE);
+    *got |= 1u << part;
+    if (*got != ~0u >> (32 - send->count))
+      return 1;
+  }
+  return 0;
+}
+
+// send a request and wait for the reply carrying its sequence number,
+// replies to earlier retransmissions or from other senders are dropped.
+// Retransmits with exponential backoff, -1 once RPC_TRIES sends go unanswered.
+// A block range goes out, and a READV range comes back, as one burst.
+int Sd_Msg(MFS_MSG_t *send, MFS_MSG_t *receive)
+{
+  if (s_sd < 0)
+    return -1;
+  // a child forked after MFS_Init must not share its parent's replies
+  if (getpid() != s_pid)
+  {
+    UDP_Close(s_sd);
+    s_sd = UDP_Open(0);
+    if (s_sd <= 0)
+    {
+      s_sd = -1;
+      return -1;
+    }
+    UDP_SetRcvBuf(s_sd, RPC_RCVBUF);
+    s_pid = getpid();
+  }
+  send->seq = ++s_seq;
+  int parts = send->req == WRITEV ? send->count : 1;
+  MFS_WireHdr_t hdr[MFS_RANGE_MAX];
+  MFS_WireRange_t range[MFS_RANGE_MAX];
+  struct iovec iov[MFS_RANGE_MAX * 3];
+  for (int i = 0; i < parts; i++)
+    msg_encode(send, i, &hdr[i], &range[i], &iov[i * 3]);
 
-      fd_set fdset;
+  struct sockaddr_in addrRcv[MFS_RANGE_MAX];
+  int lens[MFS_RANGE_MAX];
+  unsigned int got = 0, got_before = 0;
+  fd_set fdset;
   struct timeval tv;
-  tv.tv_sec = 3;
-  tv.tv_usec = 0;
+  s_stats.rpcs++;
 
-  int times = 5;
-  do
+  long rto = s_rto;
+  for (int tries = 0; tries < RPC_TRIES; tries++)
   {
-    FD_ZERO(&fdset);
-    FD_SET(sd, &fdset);
-    UDP_Write(sd, &addrSnd, (char *)send, sizeof(MFS_MSG_t));
-    if (select(sd + 1, &fdset, NULL, NULL, &tv))
+    // a burst that was partly answered lost datagrams rather than found
+    // the server unreachable, it is resent without backing off. With a
+    // burst some loss is likely, its backoff does not outlive the request
+    if (tries > 0 && got == got_before)
     {
-      rc = UDP_Read(sd, &addrRcv, (char *)receive, sizeof(MFS_MSG_t));
-      if (rc > 0)
-      {
-        UDP_Close(sd);
-        return 0;
-      }
+      rto = rto * 2 < RTO_MAX ? rto * 2 : RTO_MAX;
+      if (parts == 1 && send->req != READV)
+        s_rto = rto;
     }
-    else
+    if (tries > 0)
+      s_stats.retransmits++;
+    got_before = got;
+
+    long sent = rpc_now_usec();
+    long deadline = sent + rto;
+    UDP_WriteBurst(s_sd, &s_addr, iov, 3, parts);
+    while (1)
     {
-      times--;
+      long left = deadline - rpc_now_usec();
+      if (left <= 0)
+        break;
+      tv.tv_sec = left / 1000000L;
+      tv.tv_usec = left % 1000000L;
+      FD_ZERO(&fdset);
+      FD_SET(s_sd, &fdset);
+      if (select(s_sd + 1, &fdset, NULL, NULL, &tv) <= 0)
+        break;
+
+      int n = UDP_ReadBurst(s_sd, addrRcv, s_rx, MFS_WIRE_MAX, lens, MFS_RANGE_MAX);
+      for (int i = 0; i < n; i++)
+      {
+        if (addrRcv[i].sin_addr.s_addr != s_addr.sin_addr.s_addr || addrRcv[i].sin_port != s_addr.sin_port)
+          continue;
+        if (msg_decode_reply(s_rx + i * MFS_WIRE_MAX, lens[i], send, receive, &got) == 0)
+        {
+          if (tries == 0)
+            rtt_sample(rpc_now_usec() - sent);
+          return 0;
+        }
+      }
     }
-  } while (1);
+  }
+  s_stats.failures++;
+  return -1;
+}
+
+int MFS_RpcStats(MFS_RpcStats_t *m)
+{
+  *m = s_stats;
+  m->srtt_us = s_srtt;
+  m->rto_us = s_rto;
+  return 0;
+}
+
+int MFS_CacheInit(int bytes)
+{
+  free(s_bc);
+  free(s_bc_hash);
+  s_bc = NULL;
+  s_bc_hash = NULL;
+  s_bc_size = bytes > 0 ? bytes / MFS_BLOCK_SIZE : 0;
+  s_bc_head = -1;
+  s_bc_tail = -1;
+  if (s_bc_size == 0)
+    return 0;
+
+  s_bc = (bcache_ent_t*)malloc(sizeof(bcache_ent_t) * s_bc_size);
+  s_bc_hash = (int*)malloc(sizeof(int) * s_bc_size);
+  if (s_bc == NULL || s_bc_hash == NULL)
+  {
+    free(s_bc);
+    free(s_bc_hash);
+    s_bc = NULL;
+    s_bc_hash = NULL;
+    s_bc_size = 0;
+    return -1;
+  }
+  for (int i = 0; i < s_bc_size; i++)
+  {
+    s_bc[i].inum = -1;
+    s_bc_hash[i] = -1;
+    bcache_lru_front(i);
+  }
+  return 0;
+}
+
+int MFS_ReadAhead(int blocks)
+{
+  if (blocks < 0)
+    blocks = 0;
+  s_ra_window = blocks < MFS_RANGE_MAX - 1 ? blocks : MFS_RANGE_MAX - 1;
+  s_ra_inum = -1;
+  s_ra_unleased = -1;
+  return 0;
+}
+
+int MFS_AttrCacheInit(int entries, int ttl_ms)
+{
+  free(s_ac_names);
+  free(s_ac_attrs);
+  s_ac_names = NULL;
+  s_ac_attrs = NULL;
+  s_ac_size = 0;
+  s_ac_ttl = ttl_ms * 1000L;
+  if (entries <= 0 || ttl_ms <= 0)
+    return 0;
+
+  s_ac_names = (name_ent_t*)malloc(sizeof(name_ent_t) * entries);
+  s_ac_attrs = (attr_ent_t*)malloc(sizeof(attr_ent_t) * entries);
+  if (s_ac_names == NULL || s_ac_attrs == NULL)
+  {
+    free(s_ac_names);
+    free(s_ac_attrs);
+    s_ac_names = NULL;
+    s_ac_attrs = NULL;
+    return -1;
+  }
+  for (int i = 0; i < entries; i++)
+  {
+    s_ac_names[i].pinum = -1;
+    s_ac_attrs[i].inum = -1;
+  }
+  s_ac_size = entries;
+  return 0;
 }
 
 int MFS_Init(char *hostname, int port)
 {
-  s_host = hostname;
-  s_port = port;
+  if (s_sd >= 0)
+    UDP_Close(s_sd);
+  s_sd = -1;
+  if (UDP_FillSockAddr(&s_addr, hostname, port) < 0)
+    return -1;
+  int sd = UDP_Open(0);
+  if (sd <= 0)
+    return -1;
+  s_sd = sd;
+  UDP_SetRcvBuf(sd, RPC_RCVBUF);
+  s_pid = getpid();
+  // the server remembers requests by address and sequence number, a client
+  // that gets a recycled port must not start where the last one left off
+  s_seq = (int)((rpc_now_usec() ^ ((long)s_pid << 20)) & 0x3fffffff);
   return 0;
 }
 
@@ -69,28 +613,71 @@ int MFS_Lookup(int pinum, char *name)
 		return -1;
 	}
 
+  name_ent_t *e = acache_name_find(pinum, name);
+  if (e != NULL)
+  {
+    s_stats.meta_hits++;
+    return e->inum;
+  }
+
   MFS_MSG_t msg_sd, msg_rc;
   msg_sd.inum = pinum;
   strcpy(msg_sd.name, name);
   msg_sd.req = LOOKUP;
 
-  if (Sd_Msg(&msg_sd, &msg_rc, s_host, s_port) < 0)
+  if (Sd_Msg(&msg_sd, &msg_rc) < 0)
   {
     return -1;
   }
+  acache_name_set(pinum, name, msg_rc.inum);
+  return msg_rc.inum;
+}
+
+int MFS_LookupPath(int pinum, char *path, MFS_Stat_t *m)
+{
+  if (path == NULL || strlen(path) > MFS_PATH_MAX)
+  {
+    return -1;
+  }
+
+  MFS_MSG_t msg_sd, msg_rc;
+  msg_sd.inum = pinum;
+  strcpy(msg_sd.buffer, path);
+  msg_sd.req = LOOKUP_PATH;
+
+  if (Sd_Msg(&msg_sd, &msg_rc) < 0 || msg_rc.inum < 0)
+  {
+    return -1;
+  }
+  acache_attr_set(msg_rc.inum, &msg_rc.stat);
+  if (m != NULL)
+  {
+    m->type = msg_rc.stat.type;
+    m->size = msg_rc.stat.size;
+  }
   return msg_rc.inum;
 }
 
 int MFS_Stat(int inum, MFS_Stat_t *m)
 {
+  attr_ent_t *e = acache_attr_find(inum);
+  if (e != NULL)
+  {
+    s_stats.meta_hits++;
+    m->type = e->stat.type;
+    m->size = e->stat.size;
+    return 0;
+  }
+
   MFS_MSG_t msg_sd, msg_rc;
   msg_sd.inum = inum;
   msg_sd.req = STAT;
 
-  if (Sd_Msg(&msg_sd, &msg_rc, s_host, s_port) < 0)
+  if (Sd_Msg(&msg_sd, &msg_rc) < 0 || msg_rc.inum < 0)
   {
     return -1;
   }
+  acache_attr_set(inum, &msg_rc.stat);
   m->type = msg_rc.stat.type;
   m->size = msg_rc.stat.size;
   return 0;
@@ -98,41 +685,155 @@ int MFS_Stat(int inum, MFS_Stat_t *m)
 
 int MFS_Write(int inum, char *buffer, int block)
 {
+  bcache_drop(inum, block, 1);
+  acache_attr_drop(inum);
   MFS_MSG_t msg_sd, msg_rc;
   msg_sd.inum = inum;
   msg_sd.block = block;
-  for (int i = 0; i < MFS_BLOCK_SIZE; i++)
-  {
-    msg_sd.buffer[i] = buffer[i];
-  }
+  msg_sd.data = buffer;
   msg_sd.req = WRITE;
 
-  if (Sd_Msg(&msg_sd, &msg_rc, s_host, s_port) < 0)
+  if (Sd_Msg(&msg_sd, &msg_rc) < 0)
   {
     return -1;
   }
   return msg_rc.inum;
 }
 
+// read block and count - 1 blocks after it of a sequential reader into the
+// cache, the first also into buffer; -1 if the range is not all written
+int read_ahead(int inum, char *buffer, int block, int count, long asked)
+{
+  MFS_MSG_t msg_sd, msg_rc;
+  char blocks[MFS_RANGE_MAX * MFS_BLOCK_SIZE];
+  msg_sd.inum = inum;
+  msg_sd.block = block;
+  msg_sd.count = count;
+  msg_sd.lease = BCACHE_LEASE;
+  msg_sd.req = READV;
+  msg_rc.blocks = blocks;
+
+  if (Sd_Msg(&msg_sd, &msg_rc) < 0 || msg_rc.inum < 0)
+  {
+    return -1;
+  }
+  memcpy(buffer, blocks, MFS_BLOCK_SIZE);
+  s_stats.ahead_fetched += count - 1;
+  if (msg_rc.lease == 0)
+  {
+    s_stats.ahead_wasted += count - 1;
+    s_ra_unleased = inum;
+    return 0;
+  }
+  bcache_insert(inum, block, blocks, asked + msg_rc.lease, 0);
+  for (int i = 1; i < count; i++)
+    bcache_insert(inum, block + i, blocks + i * MFS_BLOCK_SIZE, asked + msg_rc.lease, 1);
+  return 0;
+}
+
 int MFS_Read(int inum, char *buffer, int block)
 {
+  long asked = rpc_now_usec();
+  int sequential = inum == s_ra_inum && block == s_ra_next;
+  s_ra_inum = inum;
+  s_ra_next = block + 1;
+  int slot = bcache_find(inum, block);
+  if (slot != -1 && s_bc[slot].expires > asked)
+  {
+    memcpy(buffer, s_bc[slot].data, MFS_BLOCK_SIZE);
+    bcache_lru_unlink(slot);
+    bcache_lru_front(slot);
+    s_stats.cache_hits++;
+    if (s_bc[slot].ahead)
+      s_stats.ahead_hits++;
+    s_bc[slot].ahead = 0;
+    return 0;
+  }
+
+  // not past the end of the file where we know it, nor more than the cache holds
+  int ahead = sequential && s_bc_size > 1 && inum != s_ra_unleased ? s_ra_window : 0;
+  if (ahead > s_bc_size - 1)
+    ahead = s_bc_size - 1;
+  attr_ent_t *a = acache_attr_find(inum);
+  if (a != NULL && block + 1 + ahead > (a->stat.size + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE)
+    ahead = (a->stat.size + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE - block - 1;
+  if (ahead > 0)
+  {
+    if (read_ahead(inum, buffer, block, ahead + 1, asked) == 0)
+      return 0;
+    // the range runs past the end, start over once reads go on from here
+    s_ra_next = -1;
+  }
+
   MFS_MSG_t msg_sd, msg_rc;
   msg_sd.inum = inum;
   msg_sd.block = block;
+  msg_sd.lease = s_bc_size > 0 ? BCACHE_LEASE : 0;
   msg_sd.req = READ;
+  msg_rc.data = buffer;
 
-  if (Sd_Msg(&msg_sd, &msg_rc, s_host, s_port) < 0)
+  if (Sd_Msg(&msg_sd, &msg_rc) < 0)
   {
     return -1;
   }
   if (msg_rc.inum >= 0)
   {
-    for (int i = 0; i < MFS_BLOCK_SIZE; i++)
+    if (msg_rc.lease > 0)
+      bcache_insert(inum, block, buffer, asked + msg_rc.lease, 0);
+    if (msg_rc.lease > 0 && inum == s_ra_unleased)
+      s_ra_unleased = -1;
+  }
+  else if (slot != -1)
+    bcache_free(slot);
+  return msg_rc.inum;
+}
+
+// ranges longer than MFS_RANGE_MAX blocks go as several requests, each
+// written with a single inode update
+int MFS_WriteBlocks(int inum, char *buffer, int block, int count)
+{
+  MFS_MSG_t msg_sd, msg_rc;
+  if (count < 1)
+    return -1;
+  bcache_drop(inum, block, count);
+  acache_attr_drop(inum);
+  for (int done = 0; done < count; done += msg_sd.count)
+  {
+    msg_sd.inum = inum;
+    msg_sd.block = block + done;
+    msg_sd.count = count - done < MFS_RANGE_MAX ? count - done : MFS_RANGE_MAX;
+    msg_sd.blocks = buffer + done * MFS_BLOCK_SIZE;
+    msg_sd.req = WRITEV;
+
+    if (Sd_Msg(&msg_sd, &msg_rc) < 0 || msg_rc.inum < 0)
     {
-      buffer[i] = msg_rc.buffer[i];
+      return -1;
     }
   }
-  return msg_rc.inum;
+  return 0;
+}
+
+// fails if any block of the range is not written
+int MFS_ReadBlocks(int inum, char *buffer, int block, int count)
+{
+  MFS_MSG_t msg_sd, msg_rc;
+  if (count < 1)
+    return -1;
+  for (int done = 0; done < count; done += msg_sd.count)
+  {
+    msg_sd.inum = inum;
+    msg_sd.block = block + done;
+    msg_sd.count = count - done < MFS_RANGE_MAX ? count - done : MFS_RANGE_MAX;
+    msg_sd.lease = 0;
+    msg_sd.req = READV;
+    msg_rc.blocks = buffer + done * MFS_BLOCK_SIZE;
+
+    if (Sd_Msg(&msg_sd, &msg_rc) < 0 || msg_rc.inum < 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
 }
 
 int MFS_Creat(int pinum, int type, char *name)
@@ -141,13 +842,16 @@ int MFS_Creat(int pinum, int type, char *name)
 		return -1;
 	}
 
+  bcache_drop(pinum, 0, -1);
+  acache_name_drop(pinum, name);
+  acache_attr_drop(pinum);
   MFS_MSG_t msg_sd, msg_rc;
   msg_sd.inum = pinum;
   msg_sd.stat.type = type;
   strcpy(msg_sd.name, name);
   msg_sd.req = CREAT;
 
-  if (Sd_Msg(&msg_sd, &msg_rc, s_host, s_port) < 0)
+  if (Sd_Msg(&msg_sd, &msg_rc) < 0)
   {
     return -1;
   }
@@ -160,12 +864,29 @@ int MFS_Unlink(int pinum, char *name)
 		return -1;
 	}
 
+  // the reply says which inode the name left, only a server that does not
+  // costs every cached block and attribute
+  bcache_drop(pinum, 0, -1);
+  acache_attr_drop(pinum);
+  acache_name_drop(pinum, name);
   MFS_MSG_t msg_sd, msg_rc;
   msg_sd.inum = pinum;
   strcpy(msg_sd.name, name);
   msg_sd.req = UNLINK;
 
-  if (Sd_Msg(&msg_sd, &msg_rc, s_host, s_port) < 0)
+  int rc = Sd_Msg(&msg_sd, &msg_rc);
+  int victim = rc < 0 || msg_rc.inum < 0 ? 0 : msg_rc.block;
+  if (victim == 0)
+  {
+    bcache_drop(-1, 0, -1);
+    acache_attr_drop(-1);
+  }
+  else if (victim > 0)
+  {
+    bcache_drop(victim, 0, -1);
+    acache_attr_drop(victim);
+  }
+  if (rc < 0)
   {
     return -1;
   }
@@ -177,7 +898,10 @@ int MFS_Shutdown()
   MFS_MSG_t msg_sd, msg_rc;
   msg_sd.req = SHUTDOWN;
 
-  if (Sd_Msg(&msg_sd, &msg_rc, s_host, s_port) < 0)
+  int rc = Sd_Msg(&msg_sd, &msg_rc);
+  UDP_Close(s_sd);
+  s_sd = -1;
+  if (rc < 0)
   {
     return -1;
   }
@@ -9,7 +9,7 @@
 typedef struct __MFS_Stat_t
 {
 	int type; // MFS_DIRECTORY or MFS_REGULAR
-	int size; // bytes
+	int size; // bytes, always 0 for a directory
 			  // note: no permissions, access times, etc.
 } MFS_Stat_t;
 
@@ -19,13 +19,47 @@ typedef struct __MFS_DirEnt_t
 	int inum;	   // inode number of entry (-1 means entry not used)
 } MFS_DirEnt_t;
 
+// client RPC counters, for watching retransmissions on a lossy network
+typedef struct __MFS_RpcStats_t
+{
+	long rpcs;
+	long retransmits;
+	long failures; // requests given up on after every retry timed out
+	long srtt_us;  // smoothed round trip time
+	long rto_us;   // current retransmission timeout
+	long cache_hits; // MFS_Read calls answered from the block cache
+	long meta_hits;  // MFS_Lookup and MFS_Stat calls answered from the attribute cache
+	long ahead_fetched; // blocks read ahead
+	long ahead_hits;    // of them later asked for by MFS_Read
+	long ahead_wasted;  // and dropped, written, expired or never cached for
+	                    // want of a lease without that
+} MFS_RpcStats_t;
+
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
+// names separated by '/' from directory pinum, or from the root if path
+// starts with '/'; m, if not NULL, gets the stat of what it names
+int MFS_LookupPath(int pinum, char *path, MFS_Stat_t *m);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int block);
 int MFS_Read(int inum, char *buffer, int block);
+int MFS_WriteBlocks(int inum, char *buffer, int block, int count);
+int MFS_ReadBlocks(int inum, char *buffer, int block, int count);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
+int MFS_RpcStats(MFS_RpcStats_t *m);
+// keep blocks read with MFS_Read in up to bytes of memory for as long as the
+// server leases them to us; 0 turns the cache off, as it is to begin with
+int MFS_CacheInit(int bytes);
+// once MFS_Read has read two blocks of an inode in a row, fetch up to
+// blocks more after the next one it misses in the same request; they go to
+// the block cache, so only take effect with it on and while the server
+// leases the inode's blocks. 0 turns readahead off
+int MFS_ReadAhead(int blocks);
+// remember MFS_Lookup results, names not found included, and MFS_Stat
+// results in entries slots each for ttl_ms. Other clients' changes go
+// unseen until then; 0 for either turns the cache off, as it is to begin with
+int MFS_AttrCacheInit(int entries, int ttl_ms);
 
 #endif //__MFS_h__
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include "udp.h"
+#include "mfs.c"
+
+// server CPU per request: runs READs, LOOKUPs and WRITEs one at a time
+// against a running server and reads the CPU time it spent on each phase
+// from /proc. Start the server first, then
+//   ./reqbench <port> <server pid> [requests]
+// WRITEs run a tenth as many requests, each one waits for its commit.
+
+// user and system time the process has used so far, in usec
+int cpu_usec(int pid, long *user, long *sys)
+{
+  char path[64];
+  sprintf(path, "/proc/%d/stat", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+  char line[1024];
+  if (fgets(line, sizeof(line), f) == NULL)
+  {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  // the command name may hold spaces, the fields go on after its ')'
+  char *p = strrchr(line, ')');
+  unsigned long utime, stime;
+  if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+  long hz = sysconf(_SC_CLK_TCK);
+  *user = utime * 1000000 / hz;
+  *sys = stime * 1000000 / hz;
+  return 0;
+}
+
+int run_phase(char *name, int pid, int inum, int n)
+{
+  char block[MFS_BLOCK_SIZE];
+  memset(block, 7, MFS_BLOCK_SIZE);
+  long user0, sys0, user1, sys1;
+  if (cpu_usec(pid, &user0, &sys0) == -1)
+    return -1;
+
+  long start = rpc_now_usec();
+  for (int i = 0; i < n; i++)
+  {
+    int rc;
+    if (name[0] == 'R')
+      rc = MFS_Read(inum, block, 0);
+    else if (name[0] == 'L')
+      rc = MFS_Lookup(0, "reqbench") == inum ? 0 : -1;
+    else
+      rc = MFS_Write(inum, block, i % 64);
+    if (rc == -1)
+    {
+      fprintf(stderr, "%s %d failed\n", name, i);
+      return -1;
+    }
+  }
+  long wall = rpc_now_usec() - start;
+
+  if (cpu_usec(pid, &user1, &sys1) == -1)
+    return -1;
+  printf("%-6s %7d requests  %7.2f us wall  %6.2f us server user cpu  %6.2f us user + system\n",
+      name, n, (double)wall / n, (double)(user1 - user0) / n,
+      (double)(user1 - user0 + sys1 - sys0) / n);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: %s <port> <server pid> [requests]\n", argv[0]);
+    return 1;
+  }
+  int port = atoi(argv[1]);
+  int pid = atoi(argv[2]);
+  int n = argc > 3 ? atoi(argv[3]) : 200000;
+  if (MFS_Init("localhost", port) == -1)
+    return 1;
+
+  char block[MFS_BLOCK_SIZE];
+  memset(block, 7, MFS_BLOCK_SIZE);
+  MFS_Creat(0, MFS_REGULAR_FILE, "reqbench");
+  int inum = MFS_Lookup(0, "reqbench");
+  if (inum < 0 || MFS_Write(inum, block, 0) == -1)
+  {
+    fprintf(stderr, "cannot set up the file to read\n");
+    return 1;
+  }
+
+  if (run_phase("READ", pid, inum, n) == -1 ||
+      run_phase("LOOKUP", pid, inum, n) == -1 ||
+      run_phase("WRITE", pid, inum, n / 10 > 0 ? n / 10 : 1) == -1)
+    return 1;
+  return 0;
+}
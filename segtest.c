@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include "udp.h"
+#include "mfs.c"
+
+// restart test client, driven by segtest.sh:
+//   ./segtest <port> write   fills blocks 0-255 of a new file in ranges of
+//                            MFS_RANGE_MAX blocks, then writes 0-191 again,
+//                            leaving the first segment mostly dead
+//   ./segtest <port> check   reads them back, 0 if all hold what was written
+// write does not shut the server down, the script kills it.
+
+#define SEGTEST_BLOCKS (256)
+#define SEGTEST_REWRITE (192)
+
+int fill(char *buf, int block, int count, int gen)
+{
+  for (int i = 0; i < count; i++)
+  {
+    memset(buf + i * MFS_BLOCK_SIZE, gen, MFS_BLOCK_SIZE);
+    ((int*)(buf + i * MFS_BLOCK_SIZE))[0] = block + i;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "usage: %s <port> write|check\n", argv[0]);
+    return 1;
+  }
+  if (MFS_Init("localhost", atoi(argv[1])) == -1)
+    return 1;
+
+  char *buf = (char*)malloc(MFS_RANGE_MAX * MFS_BLOCK_SIZE);
+  char *want = (char*)malloc(MFS_RANGE_MAX * MFS_BLOCK_SIZE);
+  if (strcmp(argv[2], "write") == 0)
+  {
+    if (MFS_Creat(0, MFS_REGULAR_FILE, "segtest") == -1)
+      return 1;
+    int inum = MFS_Lookup(0, "segtest");
+    for (int b = 0; b < SEGTEST_BLOCKS; b += MFS_RANGE_MAX)
+    {
+      fill(buf, b, MFS_RANGE_MAX, 1);
+      if (MFS_WriteBlocks(inum, buf, b, MFS_RANGE_MAX) == -1)
+        return 1;
+    }
+    for (int b = 0; b < SEGTEST_REWRITE; b += MFS_RANGE_MAX)
+    {
+      fill(buf, b, MFS_RANGE_MAX, 2);
+      if (MFS_WriteBlocks(inum, buf, b, MFS_RANGE_MAX) == -1)
+        return 1;
+    }
+    return 0;
+  }
+
+  int inum = MFS_Lookup(0, "segtest");
+  int bad = 0;
+  for (int b = 0; b < SEGTEST_BLOCKS; b += MFS_RANGE_MAX)
+  {
+    fill(want, b, MFS_RANGE_MAX, b < SEGTEST_REWRITE ? 2 : 1);
+    if (inum < 0 || MFS_ReadBlocks(inum, buf, b, MFS_RANGE_MAX) == -1)
+      bad += MFS_RANGE_MAX;
+    else
+    {
+      for (int i = 0; i < MFS_RANGE_MAX; i++)
+        bad += memcmp(buf + i * MFS_BLOCK_SIZE, want + i * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE) != 0;
+    }
+  }
+  MFS_Shutdown();
+  printf("%d of %d blocks bad\n", bad, SEGTEST_BLOCKS);
+  return bad != 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/bash
+# restart test: kill the server with -9 once the cleaner has checkpointed
+# units it had not synced yet and more commits followed, then recover the
+# image with the -s it was written with and, from a copy, with a smaller
+# one. Both must pick the same checkpoint, roll forward as far and come
+# back with every acknowledged block. Run from the tree after make segtest.
+
+DIR=$(mktemp -d)
+PORT=$((20000 + RANDOM % 20000))
+FAIL=0
+
+./server $PORT $DIR/img 2>$DIR/log & SP=$!
+sleep 0.3
+./segtest $PORT write || FAIL=1
+kill -9 $SP; wait $SP 2>/dev/null
+cp $DIR/img $DIR/img2
+
+# recover <image> [server args]
+recover()
+{
+  ./server $PORT $1 "${@:2}" 2>$DIR/log & SP=$!
+  sleep 0.3
+  ./segtest $PORT check || FAIL=1
+  wait $SP
+  grep "^recovery" $DIR/log | sed 's/ in [0-9]* ms//'
+}
+
+recover $DIR/img > $DIR/same
+recover $DIR/img2 -s 16384 > $DIR/smaller
+cat $DIR/smaller
+if ! grep -q "ignoring -s 16384" $DIR/smaller || [ "$(head -1 $DIR/same)" != "$(head -1 $DIR/smaller)" ]
+then
+  echo "recovery differs from the one with the original -s:"
+  cat $DIR/same
+  FAIL=1
+fi
+rm -rf $DIR
+if [ $FAIL -eq 0 ]; then echo "segtest: ok"; else echo "segtest: FAILED"; fi
+exit $FAIL
@@ -6,37 +6,291 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifndef LFS_NO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "udp.h"
 #include "mfs.h"
 #include "struct.h"
 
 MFS_CR_t *cr = NULL;
 int fd = -999;
+int *inode_map = NULL; // inum -> inode address, whole imap kept in memory
+
+// storage I/O: all image access goes through io_read, io_write and io_sync.
+// Writes and syncs queue up until io_submit, which the io_uring backend
+// turns into one linked batch; queued buffers must stay put until then.
+// Build with -DLFS_NO_URING to leave io_uring out.
+enum IO_BACKEND {
+  IO_PSYNC,
+  IO_URING
+};
+
+typedef struct __io_op_t {
+	int sync; // fsync rather than a write
+	void *buf;
+	int len;
+	int off;
+} io_op_t;
+
+#define IO_QUEUE (16)
+
+int io_backend = IO_PSYNC;
+io_op_t io_queue[IO_QUEUE];
+int io_queued = 0;
+long io_submits = 0, io_ops = 0;
+int io_failed = 0; // a write or sync to the image failed, nothing from then on is durable
+
+// -m: reads come out of a read-only shared mapping of the image instead of
+// pread. Address space for the largest image offsets can name is reserved
+// once, so the mapping never moves under a reader; io_mapped is how much of
+// it the image fills and grows as submitted writes reach further out.
+// Reads past it, like recovery probing beyond the log, still use pread.
+#define IO_MAP_MAX (1L << 31)
+
+int io_mmap = 0;
+char *io_map_base = NULL;
+long io_mapped = 0;
+long io_end = 0; // end of the furthest write submitted
+long io_map_reads = 0;
+
+#ifndef LFS_NO_URING
+int ring_fd = -1;
+unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+unsigned *cq_head, *cq_tail, *cq_mask;
+struct io_uring_sqe *sqes;
+struct io_uring_cqe *cqes;
+#endif
+
+// segment writer: the log is carved into seg_size segments, segment k spans
+// [k * seg_size, (k + 1) * seg_size) less the CR at the front of segment 0.
+// Appends collect in seg_buf and reach the image in one pwrite.
+int seg_size = 1 << 20;
+char *seg_buf = NULL;
+int seg_base = 0; // log address of seg_buf[0]
+int seg_fill = 0; // bytes buffered, cr->end == seg_base + seg_fill
+long seg_flushes = 0;
+
+enum SEG_STATE {
+  SEG_FREE,   // nothing the CR reaches lives here, may be reused
+  SEG_USED,
+  SEG_ACTIVE  // being filled by the segment writer
+};
+
+int seg_count = 0;      // segments the log spans
+int *seg_live = NULL;   // live bytes per segment
+long *seg_mtime = NULL; // last append into the segment, ages it for the cleaner
+char *seg_state = NULL;
+int seg_cur = -1;
+
+// cleaner: copies what is still live in mostly dead segments to the log tail
+int clean_max_util = 50; // percent live above which a segment is left alone
+int clean_idle_ms = 100; // quiet time before the cleaner runs in the background
+int clean_min_free = 2;  // fewer free segments than this cleans after a commit
+long segs_cleaned = 0, clean_bytes = 0, clean_usec = 0, log_bytes = 0;
+
+// log units: each commit closes a unit, a summary header, the items appended
+// since it opened and a table saying what they are. Units chain through
+// their headers so recovery can roll forward from the last checkpoint.
+int unit_hdr = -1;             // log address of the open unit's header
+MFS_SumEnt_t *unit_ents = NULL;
+int unit_nent = 0, unit_cap = 0;
+int log_seq = 1;               // sequence number of the open or next unit
+int log_uncommitted = 0;       // items appended since the last commit
+
+// checkpoints: the CR is only rewritten this often, commits in between are
+// recovered by replaying the log
+int ckpt_interval = 30; // seconds between checkpoints
+int ckpt_log_mb = 16;   // or this much log written since the last one
+long ckpt_last = 0, ckpt_log_mark = 0, checkpoints = 0;
+int cr_slot = MFS_CR_SLOTS - 1; // slot the last checkpoint went to
+int cr_v3 = 0; // the slots are still MFS_CR_V3_SIZE long, see lfs_init
+int sync_end = -1, sync_seq = 0; // first unit written since the last fsync
+
+// allocation bitmap over inode numbers, a set bit is an inode in use
+unsigned long long inum_bitmap[INODE_LIMIT / 64];
+int inum_hint = 0; // no word below this one has a free bit
+
+// LRU cache of inode contents, write-through on every new inode version
+typedef struct __icache_ent_t
+{
+	int inum;
+	int addr; // log address of the cached version
+	int prev; // towards most recently used
+	int next; // towards least recently used
+	MFS_Inode_t ind;
+} icache_ent_t;
+
+icache_ent_t *icache = NULL;
+int *icache_slot = NULL; // inum -> cache slot, -1 when not cached
+int icache_size = 1024;
+int icache_used = 0;
+int icache_head = -1, icache_tail = -1;
+long icache_hits = 0, icache_misses = 0;
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// inode versions and imap pieces a commit will carry: writes to an inode
+// only change its copy here, the log gets one version of it and one of each
+// piece touched when the batch commits
+MFS_Inode_t *ino_defer = NULL;
+char *ino_deferred = NULL;  // inum -> its copy in ino_defer is the current one
+int *ino_defer_list = NULL;
+int ino_defer_cnt = 0;
+char imap_deferred[INODE_LIMIT / IMAP_ENTRIES];
+long inode_updates = 0, inode_versions = 0, imap_updates = 0, imap_versions = 0;
+
+// group commit: replies wait until the batch their request belongs to is durable
+typedef struct __pending_t
+{
+	struct sockaddr_in sock;
+	MFS_MSG_t msg;
+	long hold; // lease_now() before which the reply may not be sent
+	char *wire; // a pooled request: the datagram it came in, msg.data points into it
+} pending_t;
+
+int commit_window = 0; // usec a batch stays open, 0 commits after every request
+int commit_batch = 64; // requests per batch before it is committed early
+pending_t *pending = NULL;
+int pending_cnt = 0;
+int batch_dirty = 0;   // the open batch holds a mutating request
+long batch_deadline = 0;
+long commits = 0, commit_reqs = 0;
+long batch_seq = 0; // batches committed so far, names the open one
+
+// duplicate request cache: results of recent mutating requests keyed by
+// client address and request sequence number, so a retransmission is
+// answered again instead of being run again. Direct mapped, a collision
+// evicts the older entry.
+typedef struct __drc_ent_t
+{
+	struct sockaddr_in sock;
+	int seq;  // -1 marks an empty slot
+	int req;
+	int inum; // the result that was sent back
+	long batch; // batch the request was committed in
+	long hold;  // and when its reply may first be sent
+} drc_ent_t;
+
+int drc_size = 1024;
+drc_ent_t *drc = NULL;
+long drc_replays = 0, drc_drops = 0;
+
+// block leases: a client that caches what it reads asks for a lease with
+// its READ and serves the block locally until the lease runs out. A request
+// changing an inode ends the leases on it: none are granted until the
+// change is published, and the reply is held back until the leases already
+// granted have run out, so once a write is answered no cache still holds
+// what it overwrote. A client's own leases do not hold its writes back, it
+// drops what it changes from its cache itself.
+typedef struct __lease_t
+{
+	long until; // lease_now() when the last lease granted runs out
+	long stop;  // lease_epoch in which the inode last changed
+	struct sockaddr_in owner; // who holds the leases, if shared is 0
+	int shared;
+} lease_t;
+
+int lease_usec = 200000; // longest lease granted, 0 grants none
+lease_t *lease = NULL; // per inode
+long lease_epoch = 0;  // batches published
+long lease_hold = 0;   // the request being run may not be answered before this
+struct sockaddr_in lease_client; // and came from here
+pthread_mutex_t lease_lock = PTHREAD_MUTEX_INITIALIZER;
+pending_t *held = NULL; // committed replies waiting for leases to run out
+int held_cnt = 0, held_cap = 0;
+long leases_granted = 0, leases_held = 0;
+
+// threads: a receiver hands the lookups, STAT and the reads to reader_threads
+// readers and everything else to the writer, the main thread. Readers see
+// the inode map as of the last commit through snap_map; the log under it is
+// immutable until a checkpoint frees segments, which only happens after a
+// new snapshot is published and so once no reader can still reach them.
+typedef struct __reqq_t
+{
+	pending_t **items;
+	int cap, head, count;
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty, nonfull;
+} reqq_t;
+
+#define REQQ_CAP (256)
+
+// request pool: the receiver reads datagrams straight into pooled requests,
+// which then travel through the queues by pointer and come back once
+// answered. There are enough for both queues full, one being served by
+// every thread and a burst on its way in, so taking one never waits long.
+pending_t **pool = NULL;
+int pool_free = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_nonempty = PTHREAD_COND_INITIALIZER;
+
+int reader_threads = 4;
+reqq_t read_q, write_q;
+int *snap_map = NULL; // inode map as of the last commit
+pthread_rwlock_t snap_lock; // read held while serving, write held to publish
+long reads_served = 0;
+
+// sequential readahead: a READ of the block after the last one an inode's
+// stream served reads up to ra_window more in with it. The stream keeps
+// them and the inode it read them through for as long as that is the
+// committed version of the inode, later READs of them touch neither.
+typedef struct __ra_t
+{
+	int inum;  // -1 marks an unused stream
+	int addr;  // snap_map[inum] of the inode the stream holds
+	int next;  // block a sequential reader asks for next
+	int first; // blocks buffered from first on
+	int count;
+	int pinned; // ind holds the inode
+	MFS_Inode_t ind;
+	char *blocks;
+	pthread_mutex_t lock;
+} ra_t;
 
-int copy_inode(MFS_Inode_t *new, MFS_Inode_t *old){
-	for(int i = 0; i < INODE_PTRS; i++){
-		new->ptrs[i] = old->ptrs[i];
-	}
-	return 0;
-}
+#define RA_STREAMS (64) // direct mapped by inum
 
-int create_empty_inode(MFS_Inode_t *ind){
-	for (int i = 0; i < INODE_PTRS; i++)
-    ind->ptrs[i] = -1;
+int ra_window = 8; // blocks read ahead, 0 turns readahead off
+ra_t *ra = NULL;
+long ra_hits = 0, ra_fetched = 0, ra_wasted = 0;
+
+// WRITEV ranges the receiver is putting back together
+typedef struct __rasm_t
+{
+	struct sockaddr_in sock;
+	int seq; // -1 marks a free slot
+	int inum, first, count;
+	unsigned int got; // a bit per block of the range that has arrived
+	char *blocks;
+	long used; // rasm_clock when a datagram last arrived for it
+} rasm_t;
+
+#define RASM_SLOTS (16)
+#define RASM_RCVBUF (RASM_SLOTS * MFS_RANGE_MAX * MFS_WIRE_MAX) // room for a burst into every slot
+
+rasm_t rasm[RASM_SLOTS];
+long rasm_clock = 0;
+
+int copy_inode(MFS_Inode_t *new, MFS_Inode_t *old){
+	new->nextents = old->nextents;
+	new->index = old->index;
+	memcpy(new->ext, old->ext, sizeof(new->ext));
 	return 0;
 }
 
-int copy_imap(MFS_Imap_t *new, MFS_Imap_t *old){
-	for(int i = 0; i < IMAP_ENTRIES; i++){
-		new->inode_addr[i] = old->inode_addr[i];
-	}
+// a 28 character name fills the whole entry without a terminating \0
+int copy_name(char *dst, char *src){
+	memset(dst, 0, 28);
+	memcpy(dst, src, strnlen(src, 28));
 	return 0;
 }
 
-int create_empty_imap(MFS_Imap_t *new){
-	for(int i = 0; i < IMAP_ENTRIES; i++){
-		new->inode_addr[i] = -1;
-	}
+int create_empty_inode(MFS_Inode_t *ind){
+	ind->nextents = 0;
+	ind->index = -1;
 	return 0;
 }
 
@@ -51,13 +305,1496 @@ int inum_invalid(int inum){
 int datablock_invalid(int db){
 	if (db < 0)
 		return 1;
-	if (db >=  INODE_PTRS)
+	if (db >=  MFS_FILE_BLOCKS)
 		return 1;
 	return 0;
 }
 
+long now_usec(){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+// leases are timed by a clock that does not jump
+long lease_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int lease_init(){
+	lease = (lease_t*)calloc(INODE_LIMIT, sizeof(lease_t));
+	for (int i = 0; i < INODE_LIMIT; i++)
+		lease[i].stop = -1;
+	return 0;
+}
+
+int same_client(struct sockaddr_in *a, struct sockaddr_in *b){
+	return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+// a lease of at most want usec on inum for a reader, 0 if there is none to
+// be had. Called with snap_lock held, so a lease on data about to be
+// replaced is granted before the writer publishes and then waited out.
+int lease_grant(int inum, int want, struct sockaddr_in *sock){
+	if (want > lease_usec)
+		want = lease_usec;
+	if (want <= 0 || inum_invalid(inum))
+		return 0;
+	lease_t *l = &lease[inum];
+	pthread_mutex_lock(&lease_lock);
+	long now = lease_now();
+	if (l->stop == lease_epoch)
+		want = 0;
+	else
+	{
+		if (l->until <= now)
+		{
+			l->owner = *sock;
+			l->shared = 0;
+		}
+		else if (!same_client(&l->owner, sock))
+			l->shared = 1;
+		if (now + want > l->until)
+			l->until = now + want;
+		leases_granted++;
+	}
+	pthread_mutex_unlock(&lease_lock);
+	return want;
+}
+
+// inum is being changed by the request the writer is running
+int lease_revoke(int inum){
+	if (inum_invalid(inum))
+		return 0;
+	lease_t *l = &lease[inum];
+	pthread_mutex_lock(&lease_lock);
+	l->stop = lease_epoch;
+	if (l->until > lease_hold && (l->shared || !same_client(&l->owner, &lease_client)))
+		lease_hold = l->until;
+	pthread_mutex_unlock(&lease_lock);
+	return 0;
+}
+
+// where [off, off + len) lies in the mapping, NULL if it is not mapped
+char *io_map(int off, int len){
+	if (io_map_base == NULL || off < 0 || (long)off + len > __atomic_load_n(&io_mapped, __ATOMIC_ACQUIRE))
+		return NULL;
+	return io_map_base + off;
+}
+
+int io_map_init(){
+	struct stat f_stat;
+	if (!io_mmap || fstat(fd, &f_stat) < 0)
+		return -1;
+	void *base = mmap(NULL, IO_MAP_MAX, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED)
+	{
+		fprintf(stderr, "io: cannot map the image, using pread\n");
+		return -1;
+	}
+	io_map_base = (char*)base;
+	if (f_stat.st_size > io_end)
+		io_end = f_stat.st_size;
+	__atomic_store_n(&io_mapped, io_end, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int io_read(void *buf, int len, int off){
+	char *p = io_map(off, len);
+	if (p != NULL)
+	{
+		memcpy(buf, p, len);
+		__atomic_add_fetch(&io_map_reads, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (pread(fd, buf, len, off) != len)
+		return -1;
+	return 0;
+}
+
+// stop at the first op that fails, nothing queued after it may reach the
+// image ahead of what it was ordered behind
+int io_psync_submit(){
+	for (int i = 0; i < io_queued; i++)
+	{
+		if (io_queue[i].sync)
+		{
+			if (fsync(fd) != 0)
+				return -1;
+			continue;
+		}
+		char *buf = (char*)io_queue[i].buf;
+		int done = 0;
+		while (done < io_queue[i].len)
+		{
+			ssize_t n = pwrite(fd, buf + done, io_queue[i].len - done, (off_t)io_queue[i].off + done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return -1;
+			done += n;
+		}
+	}
+	return 0;
+}
+
+#ifndef LFS_NO_URING
+// map a ring by hand, there is no liburing to lean on
+int io_uring_init(int entries){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring_fd < 0)
+		return -1;
+
+	int sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	int cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+		sq_len = cq_len;
+	char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	char *cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		close(ring_fd);
+		ring_fd = -1;
+		return -1;
+	}
+
+	sq_head = (unsigned*)(sq + p.sq_off.head);
+	sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq + p.sq_off.array);
+	cq_head = (unsigned*)(cq + p.cq_off.head);
+	cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+// submit the queue as one chain, each op linked to the next so the fsync
+// runs after the writes, and wait for all of it in the same syscall
+int io_uring_submit(){
+	unsigned first = *sq_tail, tail = first;
+	for (int i = 0; i < io_queued; i++)
+	{
+		unsigned idx = tail & *sq_mask;
+		struct io_uring_sqe *sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = fd;
+		if (io_queue[i].sync)
+			sqe->opcode = IORING_OP_FSYNC;
+		else
+		{
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->addr = (unsigned long)io_queue[i].buf;
+			sqe->len = io_queue[i].len;
+			sqe->off = io_queue[i].off;
+		}
+		if (i < io_queued - 1)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = i;
+		sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	// an interrupted wait has still submitted, the loop below waits it out.
+	// Any other failure consumed nothing: take the entries back so the ring
+	// does not run them later, and leave the ring alone from now on
+	if (syscall(__NR_io_uring_enter, ring_fd, io_queued, io_queued, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+	{
+		__atomic_store_n(sq_tail, first, __ATOMIC_RELEASE);
+		io_backend = IO_PSYNC;
+		return -1;
+	}
+
+	// a failed or short op cancels the rest of the chain, redo it all
+	int failed = 0;
+	unsigned head = *cq_head;
+	for (int seen = 0; seen < io_queued; seen++)
+	{
+		while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+			syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		io_op_t *op = &io_queue[cqe->user_data];
+		if (cqe->res < 0 || (!op->sync && cqe->res != op->len))
+			failed = 1;
+		head++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	return failed ? -1 : 0;
+}
+#endif
+
+// hand every queued write and sync to the image, in order. Once one has
+// failed nothing more is written, a later checkpoint must not make the log
+// after the hole look valid; this and every later submit return -1.
+int io_submit(){
+	if (io_failed)
+		io_queued = 0;
+	if (io_queued == 0)
+		return io_failed ? -1 : 0;
+	io_submits++;
+	io_ops += io_queued;
+	long end = io_end;
+	for (int i = 0; i < io_queued; i++)
+	{
+		if (!io_queue[i].sync && (long)io_queue[i].off + io_queue[i].len > end)
+			end = (long)io_queue[i].off + io_queue[i].len;
+	}
+	int rc = -1;
+#ifndef LFS_NO_URING
+	if (io_backend == IO_URING)
+		rc = io_uring_submit();
+#endif
+	if (rc == -1)
+		rc = io_psync_submit();
+	io_queued = 0;
+	if (rc == -1)
+	{
+		// perror("io: write to the image failed");
+		io_failed = 1;
+		return -1;
+	}
+	io_end = end;
+	if (io_map_base != NULL)
+		__atomic_store_n(&io_mapped, io_end, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int io_write(void *buf, int len, int off){
+	if (io_queued == IO_QUEUE)
+		io_submit();
+	io_queue[io_queued].sync = 0;
+	io_queue[io_queued].buf = buf;
+	io_queue[io_queued].len = len;
+	io_queue[io_queued].off = off;
+	io_queued++;
+	return 0;
+}
+
+int io_sync(){
+	if (io_queued == IO_QUEUE)
+		io_submit();
+	io_queue[io_queued].sync = 1;
+	io_queued++;
+	return 0;
+}
+
+// pick the backend, io_uring falls back to pread/pwrite when the kernel
+// will not set up a ring
+int io_init(){
+#ifndef LFS_NO_URING
+	if (io_backend == IO_URING && io_uring_init(IO_QUEUE) == 0)
+		return 0;
+#endif
+	if (io_backend == IO_URING)
+		fprintf(stderr, "io: io_uring unavailable, using pread/pwrite\n");
+	io_backend = IO_PSYNC;
+	return 0;
+}
+
+int seg_grow(int count){
+	if (count <= seg_count)
+		return 0;
+	seg_live = (int*)realloc(seg_live, sizeof(int) * count);
+	seg_mtime = (long*)realloc(seg_mtime, sizeof(long) * count);
+	seg_state = (char*)realloc(seg_state, count);
+	for (int k = seg_count; k < count; k++)
+	{
+		seg_live[k] = 0;
+		seg_mtime[k] = 0;
+		seg_state[k] = SEG_FREE;
+	}
+	seg_count = count;
+	return 0;
+}
+
+// first log address of segment k, segment 0 starts after the CR slots
+int seg_start(int k){
+	if (k == 0)
+		return MFS_CR_SLOTS * sizeof(MFS_CR_t);
+	return k * seg_size;
+}
+
+// add delta live bytes for every segment [addr, addr + len) touches
+int seg_usage(int addr, int len, int delta){
+	seg_grow((addr + len - 1) / seg_size + 1);
+	for (int k = addr / seg_size; k * seg_size < addr + len; k++)
+	{
+		int lo = addr > k * seg_size ? addr : k * seg_size;
+		int hi = addr + len < (k + 1) * seg_size ? addr + len : (k + 1) * seg_size;
+		seg_live[k] += delta * (hi - lo);
+	}
+	return 0;
+}
+
+// a log item has been superseded, its space can be reclaimed by the cleaner
+int log_dead(int addr, int len){
+	return seg_usage(addr, len, -1);
+}
+
+// lowest segment that holds nothing live, or a new one past the end of the image
+int seg_alloc(){
+	for (int k = 0; k < seg_count; k++)
+	{
+		if (seg_state[k] == SEG_FREE)
+			return k;
+	}
+	seg_grow(seg_count + 1);
+	return seg_count - 1;
+}
+
+// segments with nothing live that wait for a checkpoint to become free
+int seg_dead_count(){
+	int n = 0;
+	for (int k = 0; k < seg_count; k++)
+	{
+		if (seg_state[k] == SEG_USED && seg_live[k] == 0)
+			n++;
+	}
+	return n;
+}
+
+int seg_free_count(){
+	int n = 0;
+	for (int k = 0; k < seg_count; k++)
+	{
+		if (seg_state[k] == SEG_FREE)
+			n++;
+	}
+	return n;
+}
+
+int seg_flush(){
+	if (seg_fill == 0)
+		return 0;
+	io_write(seg_buf, seg_fill, seg_base);
+	seg_flushes++;
+	seg_base += seg_fill;
+	seg_fill = 0;
+	return 0;
+}
+
+// first log address past the end of segment k
+int seg_end(int k){
+	return (k + 1) * seg_size;
+}
+
+// close the current segment and continue the log in segment k, which the
+// caller has already marked active
+int seg_switch(int k){
+	seg_flush();
+	io_submit(); // seg_buf is about to be reused
+	if (seg_cur != -1)
+		seg_state[seg_cur] = SEG_USED;
+
+	seg_cur = k;
+	seg_base = seg_start(seg_cur);
+	cr->end = seg_base;
+	return 0;
+}
+
+int seg_init(){
+	seg_buf = (char*)malloc(seg_size);
+	seg_fill = 0;
+	seg_cur = -1;
+	int k = seg_alloc();
+	seg_state[k] = SEG_ACTIVE;
+	seg_switch(k);
+	return 0;
+}
+
+// segments that no longer hold anything the on-disk CR can reach become free,
+// called once the CR is durable
+int seg_release(){
+	for (int k = 0; k < seg_count; k++)
+	{
+		if (seg_state[k] == SEG_USED && seg_live[k] == 0)
+			seg_state[k] = SEG_FREE;
+	}
+	return 0;
+}
+
+// FNV-1a over 32 bit words, every log item is a multiple of 4 bytes long
+int log_checksum(char *data, int len){
+	unsigned int h = 2166136261u;
+	for (int i = 0; i + 4 <= len; i += 4)
+	{
+		unsigned int w;
+		memcpy(&w, data + i, 4);
+		h ^= w;
+		h *= 16777619u;
+	}
+	return (int)h;
+}
+
+// reserve room for a unit header at the log tail, filled in by unit_close
+int unit_open(){
+	unit_hdr = cr->end;
+	memset(seg_buf + seg_fill, 0, sizeof(MFS_Sum_t));
+	seg_fill += sizeof(MFS_Sum_t);
+	cr->end += sizeof(MFS_Sum_t);
+	unit_nent = 0;
+	return 0;
+}
+
+// finish the open unit: append its entry table and fill in the header. The
+// next unit's address is fixed here, in a fresh segment when this one cannot
+// take another unit holding a full block.
+int unit_close(int flags){
+	if (unit_hdr == -1)
+		return 0;
+
+	int nbytes = cr->end - unit_hdr - sizeof(MFS_Sum_t);
+	int table = sizeof(MFS_SumEnt_t) * unit_nent;
+	memcpy(seg_buf + seg_fill, unit_ents, table);
+	seg_fill += table;
+	cr->end += table;
+
+	int next_seg = -1;
+	MFS_Sum_t *sum = (MFS_Sum_t*)(seg_buf + (unit_hdr - seg_base));
+	sum->magic = MFS_SUM_MAGIC;
+	sum->seq = log_seq;
+	sum->addr = unit_hdr;
+	sum->nbytes = nbytes;
+	sum->nentries = unit_nent;
+	sum->flags = flags;
+	if (cr->end + sizeof(MFS_Sum_t) + MFS_BLOCK_SIZE + sizeof(MFS_SumEnt_t) <= seg_end(seg_cur))
+		sum->next = cr->end;
+	else
+	{
+		next_seg = seg_alloc();
+		seg_state[next_seg] = SEG_ACTIVE;
+		sum->next = seg_start(next_seg);
+	}
+	sum->checksum = log_checksum((char*)(sum + 1), nbytes + table);
+
+	unit_hdr = -1;
+	log_seq++;
+	if (next_seg != -1)
+		seg_switch(next_seg);
+	return 0;
+}
+
+// append len bytes at the log tail, returns the log address they land at;
+// type and id go into the unit summary for recovery
+int log_append(void *data, int len, int type, int id){
+	if (unit_hdr == -1)
+		unit_open();
+	if (cr->end + len + sizeof(MFS_SumEnt_t) * (unit_nent + 1) > seg_end(seg_cur))
+	{
+		unit_close(0);
+		unit_open();
+	}
+
+	int offset = cr->end;
+	if (len > 0)
+		memcpy(seg_buf + seg_fill, data, len);
+	seg_fill += len;
+	cr->end += len;
+
+	if (unit_nent == unit_cap)
+	{
+		unit_cap = unit_cap ? unit_cap * 2 : 64;
+		unit_ents = (MFS_SumEnt_t*)realloc(unit_ents, sizeof(MFS_SumEnt_t) * unit_cap);
+	}
+	unit_ents[unit_nent].type = type;
+	unit_ents[unit_nent].id = id;
+	unit_ents[unit_nent].len = len;
+	unit_nent++;
+	log_uncommitted = 1;
+
+	if (len > 0)
+	{
+		seg_usage(offset, len, 1);
+		seg_mtime[seg_cur] = now_usec();
+		log_bytes += len;
+	}
+	return offset;
+}
+
+// read back the unit with sequence number seq at pos, 0 if its header and
+// checksum hold up; *body grows to fit, *cap is its size. Units never span
+// segments, but the image may have been written with another -s than this
+// run's, so only MFS_SEG_MAX bounds them.
+int unit_load(int pos, int seq, MFS_Sum_t *sum, char **body, int *cap){
+	if (io_read(sum, sizeof(MFS_Sum_t), pos) == -1)
+		return -1;
+	if (sum->magic != MFS_SUM_MAGIC || sum->seq != seq || sum->addr != pos)
+		return -1;
+	if (sum->nbytes < 0 || sum->nentries < 0 ||
+	    sum->nbytes + (long)sum->nentries * sizeof(MFS_SumEnt_t) > MFS_SEG_MAX - sizeof(MFS_Sum_t))
+		return -1;
+	int len = sum->nbytes + sum->nentries * sizeof(MFS_SumEnt_t);
+	if (len > *cap)
+	{
+		*body = (char*)realloc(*body, len);
+		*cap = len;
+	}
+	if (io_read(*body, len, pos + sizeof(MFS_Sum_t)) == -1)
+		return -1;
+	if (log_checksum(*body, len) != sum->checksum)
+		return -1;
+	return 0;
+}
+
+// read from the log, serving anything not yet flushed from the segment buffer
+int log_read(int offset, void *data, int len){
+	if (offset >= seg_base && offset < seg_base + seg_fill)
+	{
+		memcpy(data, seg_buf + (offset - seg_base), len);
+		return 0;
+	}
+	return io_read(data, len, offset);
+}
+
+// build the in-memory inode map from the imap pieces the CR points to
+int imap_load(){
+	for (int i = 0; i < INODE_LIMIT; i++)
+		inode_map[i] = -1;
+
+	MFS_Imap_t imp;
+	for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
+	{
+		if (cr->imap[i] == -1)
+			continue;
+		log_read(cr->imap[i], &imp, sizeof(MFS_Imap_t));
+		for (int j = 0; j < IMAP_ENTRIES; j++)
+			inode_map[i * IMAP_ENTRIES + j] = imp.inode_addr[j];
+	}
+
+	for (int i = 0; i < INODE_LIMIT / 64; i++)
+		inum_bitmap[i] = 0;
+	for (int i = 0; i < INODE_LIMIT; i++)
+	{
+		if (inode_map[i] != -1)
+			inum_bitmap[i / 64] |= 1ULL << (i % 64);
+	}
+	inum_hint = 0;
+	return 0;
+}
+
+// lowest free inode number, -1 when every inode is in use
+int inum_alloc(){
+	for (int i = inum_hint; i < INODE_LIMIT / 64; i++)
+	{
+		if (~inum_bitmap[i] != 0)
+		{
+			inum_hint = i;
+			return i * 64 + __builtin_ctzll(~inum_bitmap[i]);
+		}
+	}
+	inum_hint = INODE_LIMIT / 64;
+	return -1;
+}
+
+int inum_set_used(int inum){
+	inum_bitmap[inum / 64] |= 1ULL << (inum % 64);
+	return 0;
+}
+
+int inum_set_free(int inum){
+	inum_bitmap[inum / 64] &= ~(1ULL << (inum % 64));
+	if (inum / 64 < inum_hint)
+		inum_hint = inum / 64;
+	return 0;
+}
+
+// append the imap piece holding imp_index to the log and point the CR at it,
+// an imap piece with no live inodes is dropped from the CR instead
+int imap_flush_piece(int imp_index){
+	MFS_Imap_t imp;
+	int piece_empty = 1;
+	for (int i = 0; i < IMAP_ENTRIES; i++)
+	{
+		imp.inode_addr[i] = inode_map[imp_index * IMAP_ENTRIES + i];
+		if (imp.inode_addr[i] != -1)
+			piece_empty = 0;
+	}
+
+	if (cr->imap[imp_index] != -1)
+		log_dead(cr->imap[imp_index], sizeof(MFS_Imap_t));
+
+	if (piece_empty)
+	{
+		cr->imap[imp_index] = -1;
+		log_append(NULL, 0, SUM_IMAP_DROP, imp_index);
+		return 0;
+	}
+
+	cr->imap[imp_index] = log_append(&imp, sizeof(MFS_Imap_t), SUM_IMAP, imp_index);
+	return 0;
+}
+
+
+
+int icache_init(){
+	icache_slot = (int*)malloc(sizeof(int) * INODE_LIMIT);
+	for (int i = 0; i < INODE_LIMIT; i++)
+		icache_slot[i] = -1;
+	if (icache_size > 0)
+		icache = (icache_ent_t*)malloc(sizeof(icache_ent_t) * icache_size);
+	return 0;
+}
+
+int icache_unchain(int slot){
+	icache_ent_t *e = &icache[slot];
+	if (e->prev != -1)
+		icache[e->prev].next = e->next;
+	else
+		icache_head = e->next;
+	if (e->next != -1)
+		icache[e->next].prev = e->prev;
+	else
+		icache_tail = e->prev;
+	return 0;
+}
+
+int icache_chain_front(int slot){
+	icache[slot].prev = -1;
+	icache[slot].next = icache_head;
+	if (icache_head != -1)
+		icache[icache_head].prev = slot;
+	icache_head = slot;
+	if (icache_tail == -1)
+		icache_tail = slot;
+	return 0;
+}
+
+int icache_insert(int inum, MFS_Inode_t *ind){
+	if (icache_size <= 0)
+		return 0;
+
+	pthread_mutex_lock(&icache_lock);
+	int slot = icache_slot[inum];
+	if (slot != -1)
+	{
+		icache_unchain(slot);
+	}
+	else if (icache_used < icache_size)
+	{
+		slot = icache_used++;
+	}
+	else
+	{
+		// evict the least recently used entry, the root directory stays resident
+		slot = icache_tail;
+		if (icache[slot].inum == 0 && icache[slot].prev != -1)
+			slot = icache[slot].prev;
+		icache_unchain(slot);
+		icache_slot[icache[slot].inum] = -1;
+	}
+
+	icache[slot].inum = inum;
+	icache[slot].addr = inode_map[inum];
+	icache[slot].ind = *ind;
+	icache_slot[inum] = slot;
+	icache_chain_front(slot);
+	pthread_mutex_unlock(&icache_lock);
+	return 0;
+}
+
+int icache_drop(int inum){
+	pthread_mutex_lock(&icache_lock);
+	int slot = icache_slot[inum];
+	if (slot == -1)
+	{
+		pthread_mutex_unlock(&icache_lock);
+		return 0;
+	}
+
+	icache_unchain(slot);
+	icache_slot[inum] = -1;
+
+	// keep the used slots dense by moving the last one into the hole
+	int last = --icache_used;
+	if (slot != last)
+	{
+		icache_ent_t *e = &icache[slot];
+		*e = icache[last];
+		icache_slot[e->inum] = slot;
+		if (e->prev != -1)
+			icache[e->prev].next = slot;
+		else
+			icache_head = slot;
+		if (e->next != -1)
+			icache[e->next].prev = slot;
+		else
+			icache_tail = slot;
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return 0;
+}
+
+// block maps: where the blocks of a file lie in the log. The writer changes
+// them through a bmap_t, the readers look blocks up with bmap_addrs
+
+int inode_v1 = 0; // the image's inodes are MFS_InodeV1_t until inode_upgrade
+
+#define BMAP_SPANS (INODE_SPANS + EXT_INDEX)
+
+typedef struct __bmap_t
+{
+	MFS_Inode_t *ind;
+	// only set up once the extents have spilled to extent blocks
+	int span[BMAP_SPANS]; // extent block addresses, from the inode and index
+	MFS_ExtBlock_t *blk[BMAP_SPANS]; // extent blocks read in so far
+	char dirty[BMAP_SPANS];
+	int index_dirty;
+} bmap_t;
+
+// log address of block db in a sorted extent list, -1 if none covers it
+int ext_find(MFS_Extent_t *ext, int n, int db){
+	int lo = 0, hi = n;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (ext[mid].block + ext[mid].len <= db)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < n && ext[lo].block <= db)
+		return ext[lo].addr + (db - ext[lo].block) * MFS_BLOCK_SIZE;
+	return -1;
+}
+
+// map blocks [db, db + count) of the sorted extent list ext to the run at
+// addr, the result goes to out (room for n + 2). Whatever the blocks pointed
+// at is released, extents that continue each other in the log are merged.
+int ext_map(MFS_Extent_t *ext, int n, int db, int addr, int count, MFS_Extent_t *out){
+	MFS_Extent_t run = {db, addr, count};
+	int end = db + count;
+	int m = 0, placed = 0;
+	for (int i = 0; i < n; i++)
+	{
+		MFS_Extent_t e = ext[i];
+		int e_end = e.block + e.len;
+		if (e_end <= db || e.block >= end)
+		{
+			if (!placed && e.block >= end)
+			{
+				out[m++] = run;
+				placed = 1;
+			}
+			out[m++] = e;
+			continue;
+		}
+
+		int lo = e.block > db ? e.block : db;
+		int hi = e_end < end ? e_end : end;
+		log_dead(e.addr + (lo - e.block) * MFS_BLOCK_SIZE, (hi - lo) * MFS_BLOCK_SIZE);
+		if (e.block < db)
+		{
+			MFS_Extent_t left = {e.block, e.addr, db - e.block};
+			out[m++] = left;
+		}
+		if (e_end > end)
+		{
+			MFS_Extent_t right = {end, e.addr + (end - e.block) * MFS_BLOCK_SIZE, e_end - end};
+			out[m++] = run;
+			out[m++] = right;
+			placed = 1;
+		}
+	}
+	if (!placed)
+		out[m++] = run;
+
+	int k = 0;
+	for (int i = 1; i < m; i++)
+	{
+		if (out[k].block + out[k].len == out[i].block &&
+				out[k].addr + out[k].len * MFS_BLOCK_SIZE == out[i].addr)
+			out[k].len += out[i].len;
+		else
+			out[++k] = out[i];
+	}
+	return k + 1;
+}
+
+int bmap_open(bmap_t *bm, MFS_Inode_t *ind){
+	bm->ind = ind;
+	bm->index_dirty = 0;
+	if (ind->nextents != -1)
+		return 0;
+	memset(bm->blk, 0, sizeof(bm->blk));
+	memset(bm->dirty, 0, sizeof(bm->dirty));
+	memcpy(bm->span, ind->span, sizeof(ind->span));
+	if (ind->index == -1)
+		memset(bm->span + INODE_SPANS, 0xff, sizeof(MFS_ExtIndex_t));
+	else
+		log_read(ind->index, bm->span + INODE_SPANS, sizeof(MFS_ExtIndex_t));
+	return 0;
+}
+
+// extent block k, read in the first time it is needed
+MFS_ExtBlock_t *bmap_block(bmap_t *bm, int k){
+	if (bm->blk[k] == NULL)
+	{
+		bm->blk[k] = (MFS_ExtBlock_t*)malloc(sizeof(MFS_ExtBlock_t));
+		if (bm->span[k] == -1)
+			bm->blk[k]->nextents = 0;
+		else
+			log_read(bm->span[k], bm->blk[k], sizeof(MFS_ExtBlock_t));
+	}
+	return bm->blk[k];
+}
+
+// the extents of span k: the inode's own for k = 0 while they fit there
+int bmap_span(bmap_t *bm, int k, MFS_Extent_t **ext){
+	if (bm->ind->nextents != -1)
+	{
+		*ext = bm->ind->ext;
+		return k == 0 ? bm->ind->nextents : 0;
+	}
+	if (bm->span[k] == -1 && bm->blk[k] == NULL)
+		return 0;
+	MFS_ExtBlock_t *b = bmap_block(bm, k);
+	*ext = b->ext;
+	return b->nextents;
+}
+
+// the inode has outgrown its extents, move ext to extent blocks
+int bmap_spill(bmap_t *bm, MFS_Extent_t *ext, int n){
+	memset(bm->blk, 0, sizeof(bm->blk));
+	memset(bm->dirty, 0, sizeof(bm->dirty));
+	memset(bm->span, 0xff, sizeof(bm->span));
+	bm->ind->nextents = -1;
+	for (int i = 0; i < n; i++)
+	{
+		MFS_Extent_t e = ext[i];
+		while (e.len > 0)
+		{
+			int k = e.block / EXT_SPAN;
+			MFS_ExtBlock_t *b = bmap_block(bm, k);
+			b->ext[b->nextents] = e;
+			if (e.block + e.len > (k + 1) * EXT_SPAN)
+				b->ext[b->nextents].len = (k + 1) * EXT_SPAN - e.block;
+			e.block += b->ext[b->nextents].len;
+			e.addr += b->ext[b->nextents].len * MFS_BLOCK_SIZE;
+			e.len -= b->ext[b->nextents].len;
+			b->nextents++;
+			bm->dirty[k] = 1;
+		}
+	}
+	return 0;
+}
+
+// point blocks [db, db + count) at the run of count blocks at addr,
+// releasing what they pointed at before
+int bmap_set(bmap_t *bm, int db, int addr, int count){
+	MFS_Extent_t out[EXT_SPAN + 2];
+	MFS_Inode_t *ind = bm->ind;
+	if (ind->nextents != -1)
+	{
+		int n = ext_map(ind->ext, ind->nextents, db, addr, count, out);
+		if (n <= INODE_EXTENTS)
+		{
+			memcpy(ind->ext, out, sizeof(MFS_Extent_t) * n);
+			ind->nextents = n;
+		}
+		else
+			bmap_spill(bm, out, n);
+		return 0;
+	}
+
+	while (count > 0)
+	{
+		int k = db / EXT_SPAN;
+		int part = (k + 1) * EXT_SPAN - db < count ? (k + 1) * EXT_SPAN - db : count;
+		MFS_ExtBlock_t *b = bmap_block(bm, k);
+		b->nextents = ext_map(b->ext, b->nextents, db, addr, part, out);
+		memcpy(b->ext, out, sizeof(MFS_Extent_t) * b->nextents);
+		bm->dirty[k] = 1;
+		db += part;
+		addr += part * MFS_BLOCK_SIZE;
+		count -= part;
+	}
+	return 0;
+}
+
+// write back the extent blocks that changed and the index if it did; the
+// inode is written by the caller
+int bmap_store(bmap_t *bm, int inum){
+	MFS_Inode_t *ind = bm->ind;
+	if (ind->nextents != -1)
+		return 0;
+	for (int k = 0; k < BMAP_SPANS; k++)
+	{
+		if (bm->blk[k] == NULL)
+			continue;
+		if (bm->dirty[k])
+		{
+			if (bm->span[k] != -1)
+				log_dead(bm->span[k], sizeof(MFS_ExtBlock_t));
+			bm->span[k] = -1;
+			if (bm->blk[k]->nextents > 0)
+				bm->span[k] = log_append(bm->blk[k], sizeof(MFS_ExtBlock_t), SUM_EXTENT, inum);
+			if (k >= INODE_SPANS)
+				bm->index_dirty = 1;
+		}
+		free(bm->blk[k]);
+		bm->blk[k] = NULL;
+	}
+	memcpy(ind->span, bm->span, sizeof(ind->span));
+
+	if (bm->index_dirty)
+	{
+		if (ind->index != -1)
+			log_dead(ind->index, sizeof(MFS_ExtIndex_t));
+		ind->index = log_append(bm->span + INODE_SPANS, sizeof(MFS_ExtIndex_t), SUM_EXTENT, inum);
+	}
+	return 0;
+}
+
+// done with a map that was only looked at
+int bmap_close(bmap_t *bm){
+	if (bm->ind->nextents != -1)
+		return 0;
+	for (int k = 0; k < BMAP_SPANS; k++)
+	{
+		free(bm->blk[k]);
+		bm->blk[k] = NULL;
+	}
+	return 0;
+}
 
+// log addresses of blocks [db, db + count), -1 for blocks never written.
+// Readers pass snap and read the committed log only, the writer sees its
+// own updates still in the segment buffer
+int bmap_addrs(MFS_Inode_t *ind, int db, int count, int *addrs, int snap){
+	if (ind->nextents != -1)
+	{
+		for (int i = 0; i < count; i++)
+			addrs[i] = ext_find(ind->ext, ind->nextents, db + i);
+		return 0;
+	}
+
+	MFS_ExtBlock_t b;
+	int loaded = -1;
+	for (int i = 0; i < count; i++)
+	{
+		int k = (db + i) / EXT_SPAN;
+		if (k != loaded)
+		{
+			int addr = -1;
+			if (k < INODE_SPANS)
+				addr = ind->span[k];
+			else if (ind->index != -1)
+			{
+				int at = ind->index + (k - INODE_SPANS) * sizeof(int);
+				if ((snap ? io_read(&addr, sizeof(int), at) : log_read(at, &addr, sizeof(int))) == -1)
+					return -1;
+			}
+			b.nextents = 0;
+			if (addr != -1 && (snap ? io_read(&b, sizeof(b), addr) : log_read(addr, &b, sizeof(b))) == -1)
+				return -1;
+			loaded = k;
+		}
+		addrs[i] = ext_find(b.ext, b.nextents, db + i);
+	}
+	return 0;
+}
+
+// the block map of an inode from before extents
+int inode_from_v1(MFS_InodeV1_t *old, MFS_Inode_t *ind){
+	MFS_Extent_t out[INODE_PTRS + 2];
+	ind->size = old->size;
+	ind->type = old->type;
+	ind->nextents = 0;
+	ind->index = -1;
+	for (int i = 0; i < INODE_PTRS; i++)
+	{
+		if (old->ptrs[i] == -1)
+			continue;
+		ind->nextents = ext_map(ind->ext, ind->nextents, i, old->ptrs[i], 1, out);
+		memcpy(ind->ext, out, sizeof(MFS_Extent_t) * ind->nextents);
+	}
+	return 0;
+}
+
+// fetch the current version of an inode, -1 if inum is not allocated
+int inode_read(int inum, MFS_Inode_t *ind){
+	if (ino_deferred[inum])
+	{
+		*ind = ino_defer[inum];
+		return 0;
+	}
+
+	int ind_offset = inode_map[inum];
+	if (ind_offset == -1)
+		return -1;
+
+	pthread_mutex_lock(&icache_lock);
+	int slot = icache_slot[inum];
+	if (slot != -1)
+	{
+		icache_hits++;
+		*ind = icache[slot].ind;
+		icache_unchain(slot);
+		icache_chain_front(slot);
+		pthread_mutex_unlock(&icache_lock);
+		return 0;
+	}
+	icache_misses++;
+	pthread_mutex_unlock(&icache_lock);
+
+	if (inode_v1)
+	{
+		MFS_InodeV1_t old;
+		log_read(ind_offset, &old, sizeof(MFS_InodeV1_t));
+		inode_from_v1(&old, ind);
+	}
+	else
+		log_read(ind_offset, ind, sizeof(MFS_Inode_t));
+	icache_insert(inum, ind);
+	return 0;
+}
+
+// fetch an inode as of the last commit, for the readers; the cache only
+// serves it while the cached version is the committed one. The caller holds
+// snap_lock.
+int inode_read_snap(int inum, MFS_Inode_t *ind){
+	int ind_offset = snap_map[inum];
+	if (ind_offset == -1)
+		return -1;
+
+	pthread_mutex_lock(&icache_lock);
+	int slot = icache_slot[inum];
+	if (slot != -1 && icache[slot].addr == ind_offset)
+	{
+		icache_hits++;
+		*ind = icache[slot].ind;
+		icache_unchain(slot);
+		icache_chain_front(slot);
+		pthread_mutex_unlock(&icache_lock);
+		return 0;
+	}
+	icache_misses++;
+	pthread_mutex_unlock(&icache_lock);
+
+	return io_read(ind, sizeof(MFS_Inode_t), ind_offset);
+}
+
+// append a new version of an inode to the log and make it current
+int inode_write(int inum, MFS_Inode_t *ind){
+	if (inode_map[inum] != -1)
+		log_dead(inode_map[inum], sizeof(MFS_Inode_t));
+
+	int offset = log_append(ind, sizeof(MFS_Inode_t), SUM_INODE, inum);
+	inode_map[inum] = offset;
+	inum_set_used(inum);
+	icache_insert(inum, ind);
+	return offset;
+}
+
+// release an inode, its blocks and its extent blocks
+int inode_free(int inum, MFS_Inode_t *ind){
+	log_dead(inode_map[inum], sizeof(MFS_Inode_t));
+	bmap_t bm;
+	bmap_open(&bm, ind);
+	for (int k = 0; k < (ind->nextents == -1 ? BMAP_SPANS : 1); k++)
+	{
+		MFS_Extent_t *ext;
+		int n = bmap_span(&bm, k, &ext);
+		for (int i = 0; i < n; i++)
+			log_dead(ext[i].addr, ext[i].len * MFS_BLOCK_SIZE);
+		if (ind->nextents == -1 && bm.span[k] != -1)
+			log_dead(bm.span[k], sizeof(MFS_ExtBlock_t));
+	}
+	if (ind->nextents == -1 && ind->index != -1)
+		log_dead(ind->index, sizeof(MFS_ExtIndex_t));
+	bmap_close(&bm);
+
+	inode_map[inum] = -1;
+	ino_deferred[inum] = 0;
+	inum_set_free(inum);
+	icache_drop(inum);
+	return 0;
+}
+
+int inode_defer_init(){
+	ino_defer = (MFS_Inode_t*)malloc(sizeof(MFS_Inode_t) * INODE_LIMIT);
+	ino_deferred = (char*)calloc(INODE_LIMIT, 1);
+	ino_defer_list = (int*)malloc(sizeof(int) * INODE_LIMIT);
+	memset(imap_deferred, 0, sizeof(imap_deferred));
+	return 0;
+}
+
+// append every deferred inode version, then the imap pieces they and any
+// freed inodes left behind
+int inode_flush_deferred(){
+	for (int i = 0; i < ino_defer_cnt; i++)
+	{
+		int inum = ino_defer_list[i];
+		if (!ino_deferred[inum])
+			continue; // freed since, or listed twice
+		ino_deferred[inum] = 0;
+		inode_write(inum, &ino_defer[inum]);
+		inode_versions++;
+	}
+	ino_defer_cnt = 0;
+
+	for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
+	{
+		if (!imap_deferred[i])
+			continue;
+		imap_deferred[i] = 0;
+		imap_flush_piece(i);
+		imap_versions++;
+	}
+	return 0;
+}
+
+// make ind the current version of an allocated inode as of the next commit;
+// a new inode goes to the log at once so its number is taken
+int inode_defer(int inum, MFS_Inode_t *ind){
+	inode_updates++;
+	if (inode_map[inum] == -1)
+	{
+		inode_versions++;
+		return inode_write(inum, ind);
+	}
 
+	if (!ino_deferred[inum])
+	{
+		if (ino_defer_cnt == INODE_LIMIT)
+			inode_flush_deferred();
+		ino_deferred[inum] = 1;
+		ino_defer_list[ino_defer_cnt++] = inum;
+	}
+	ino_defer[inum] = *ind;
+	return 0;
+}
+
+// the imap piece holding imp_index goes to the log with the next commit
+int imap_defer(int imp_index){
+	imap_updates++;
+	imap_deferred[imp_index] = 1;
+	return 0;
+}
+
+// rewrite every inode of an image from before extents as an MFS_Inode_t, all
+// in one commit so recovery finds either none or all of them upgraded
+int inode_upgrade(){
+	MFS_Inode_t ind;
+	for (int inum = 0; inum < INODE_LIMIT; inum++)
+	{
+		if (inode_read(inum, &ind) == -1)
+			continue;
+		log_dead(inode_map[inum], sizeof(MFS_InodeV1_t));
+		inode_map[inum] = -1;
+		inode_write(inum, &ind);
+	}
+	inode_v1 = 0;
+
+	for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
+	{
+		if (cr->imap[i] != -1)
+			imap_flush_piece(i);
+	}
+	return 0;
+}
+
+// recompute live bytes per segment by walking everything the CR reaches
+int seg_usage_rebuild(int image_size){
+	seg_grow(image_size / seg_size + 1);
+	for (int k = 0; k < seg_count; k++)
+		seg_live[k] = 0;
+
+	for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
+	{
+		if (cr->imap[i] != -1)
+			seg_usage(cr->imap[i], sizeof(MFS_Imap_t), 1);
+	}
+
+	MFS_Inode_t ind;
+	bmap_t bm;
+	for (int inum = 0; inum < INODE_LIMIT; inum++)
+	{
+		if (inode_read(inum, &ind) == -1)
+			continue;
+		seg_usage(inode_map[inum], inode_v1 ? sizeof(MFS_InodeV1_t) : sizeof(MFS_Inode_t), 1);
+		bmap_open(&bm, &ind);
+		for (int k = 0; k < (ind.nextents == -1 ? BMAP_SPANS : 1); k++)
+		{
+			MFS_Extent_t *ext;
+			int n = bmap_span(&bm, k, &ext);
+			for (int i = 0; i < n; i++)
+				seg_usage(ext[i].addr, ext[i].len * MFS_BLOCK_SIZE, 1);
+			if (ind.nextents == -1 && bm.span[k] != -1)
+				seg_usage(bm.span[k], sizeof(MFS_ExtBlock_t), 1);
+		}
+		if (ind.nextents == -1 && ind.index != -1)
+			seg_usage(ind.index, sizeof(MFS_ExtIndex_t), 1);
+		bmap_close(&bm);
+	}
+
+	long now = now_usec();
+	for (int k = 0; k < seg_count; k++)
+	{
+		seg_state[k] = seg_live[k] > 0 ? SEG_USED : SEG_FREE;
+		seg_mtime[k] = now;
+	}
+	return 0;
+}
+
+// directories are linear hash tables of MFS_Dir_t buckets, one per block,
+// and a directory's size is that of its buckets. With n buckets, where
+// 2^k <= n < 2^(k+1), a name hashing to h lives in bucket h mod 2^(k+1), or
+// in h mod 2^k while that one has yet to be split. "." and ".." keep the
+// first two entries of bucket 0.
+
+int dir_v1 = 0; // the image's directories are unhashed until dir_upgrade
+
+unsigned int dent_hash(char *name){
+	unsigned int h = 2166136261u;
+	for (int i = 0; i < 28 && name[i] != '\0'; i++)
+	{
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int dir_buckets(MFS_Inode_t *ind){
+	return ind->size < MFS_BLOCK_SIZE ? 1 : ind->size / MFS_BLOCK_SIZE;
+}
+
+// bucket of name in a directory of n buckets
+int dir_bucket(char *name, int n){
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return 0;
+	unsigned int h = dent_hash(name);
+	unsigned int half = 1;
+	while (half * 2 <= (unsigned int)n)
+		half *= 2;
+	if ((h & (half * 2 - 1)) < (unsigned int)n)
+		return h & (half * 2 - 1);
+	return h & (half - 1);
+}
+
+int dir_clear(MFS_Dir_t *dir){
+	memset(dir, 0, sizeof(MFS_Dir_t));
+	for (int j = 0; j < DIR_ENTRIES; j++)
+		dir->entries[j].inum = -1;
+	return 0;
+}
+
+// entry of name in a bucket, -1 if it is not there
+int dir_slot(MFS_Dir_t *dir, char *name){
+	for (int j = 0; j < DIR_ENTRIES; j++)
+	{
+		if (dir->entries[j].inum != -1 && strncmp(dir->entries[j].name, name, 28) == 0)
+			return j;
+	}
+	return -1;
+}
+
+// first unused entry of a bucket, -1 if it is full; used counts the rest
+int dir_free_slot(MFS_Dir_t *dir, int *used){
+	int slot = -1;
+	*used = 0;
+	for (int j = 0; j < DIR_ENTRIES; j++)
+	{
+		if (dir->entries[j].inum != -1)
+			(*used)++;
+		else if (slot == -1)
+			slot = j;
+	}
+	return slot;
+}
+
+// bucket b of a directory as the writer sees it
+int dir_read(MFS_Inode_t *ind, int b, MFS_Dir_t *dir){
+	int addr;
+	bmap_addrs(ind, b, 1, &addr, 0);
+	if (addr == -1)
+		return dir_clear(dir);
+	return log_read(addr, dir, sizeof(MFS_Dir_t));
+}
+
+// append bucket b and point the directory at it; the inode is written by
+// the caller
+int dir_write(int inum, MFS_Inode_t *ind, int b, MFS_Dir_t *dir){
+	int offset = log_append(dir, sizeof(MFS_Dir_t), SUM_DIR, inum);
+	bmap_t bm;
+	bmap_open(&bm, ind);
+	bmap_set(&bm, b, offset, 1);
+	bmap_store(&bm, inum);
+	return offset;
+}
+
+// bucket and entry of name, -1 if the directory has no such entry
+int dir_find(MFS_Inode_t *ind, char *name, MFS_Dir_t *dir, int *b){
+	*b = dir_bucket(name, dir_buckets(ind));
+	dir_read(ind, *b, dir);
+	return dir_slot(dir, name);
+}
+
+// split the next bucket in line between itself and a new last bucket
+int dir_split(int inum, MFS_Inode_t *ind){
+	int n = dir_buckets(ind);
+	if (n >= MFS_FILE_BLOCKS)
+		return -1;
+	int half = 1;
+	while (half * 2 <= n)
+		half *= 2;
+	int p = n - half;
+
+	MFS_Dir_t keep, moved;
+	dir_read(ind, p, &keep);
+	dir_clear(&moved);
+	int m = 0;
+	for (int j = p == 0 ? 2 : 0; j < DIR_ENTRIES; j++)
+	{
+		if (keep.entries[j].inum == -1 || dir_bucket(keep.entries[j].name, n + 1) != n)
+			continue;
+		moved.entries[m++] = keep.entries[j];
+		memset(keep.entries[j].name, 0, 28);
+		keep.entries[j].inum = -1;
+	}
+	if (m > 0)
+		dir_write(inum, ind, p, &keep);
+	dir_write(inum, ind, n, &moved);
+	ind->size = (n + 1) * MFS_BLOCK_SIZE;
+	return 0;
+}
+
+// enter name in directory pinum, which only rewrites its bucket. A full
+// bucket is made room in by splitting, up to doubling the directory, and one
+// more bucket is split once it is three quarters full. The caller writes
+// the directory inode, also when there was no room after all.
+int dir_add(int pinum, MFS_Inode_t *ind, char *name, int inum){
+	int n = dir_buckets(ind), start = n;
+	MFS_Dir_t dir;
+	int b = dir_bucket(name, n);
+	dir_read(ind, b, &dir);
+	int used, slot = dir_free_slot(&dir, &used);
+	while (slot == -1)
+	{
+		if (n >= start * 2 || dir_split(pinum, ind) == -1)
+		{
+			// perror("creat: directory is full");
+			return -1;
+		}
+		n++;
+		b = dir_bucket(name, n);
+		dir_read(ind, b, &dir);
+		slot = dir_free_slot(&dir, &used);
+	}
+
+	copy_name(dir.entries[slot].name, name);
+	dir.entries[slot].inum = inum;
+	dir_write(pinum, ind, b, &dir);
+	if ((used + 1) * 4 > DIR_ENTRIES * 3)
+		dir_split(pinum, ind);
+	return 0;
+}
+
+// a directory holds nothing but . and ..
+int dir_empty(MFS_Inode_t *ind){
+	MFS_Dir_t dir;
+	for (int b = 0; b < dir_buckets(ind); b++)
+	{
+		dir_read(ind, b, &dir);
+		for (int j = b == 0 ? 2 : 0; j < DIR_ENTRIES; j++)
+		{
+			if (dir.entries[j].inum != -1)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// rehash every directory of an image from before hashed directories. A
+// directory gets at least as many buckets as it had blocks, so the buckets
+// replace them all. Running it again on hashed directories is harmless,
+// recovery may have replayed it without the checkpoint that followed.
+int dir_upgrade(){
+	MFS_Inode_t ind;
+	char dirty_piece[INODE_LIMIT / IMAP_ENTRIES];
+	memset(dirty_piece, 0, sizeof(dirty_piece));
+	for (int inum = 0; inum < INODE_LIMIT; inum++)
+	{
+		if (inode_read(inum, &ind) == -1 || ind.type != MFS_DIRECTORY)
+			continue;
+
+		int blocks = ind.size / MFS_BLOCK_SIZE > INODE_PTRS ? ind.size / MFS_BLOCK_SIZE : INODE_PTRS;
+		if (blocks > MFS_FILE_BLOCKS)
+			blocks = MFS_FILE_BLOCKS;
+		int *addrs = (int*)malloc(sizeof(int) * blocks);
+		MFS_DirEnt_t *ents = (MFS_DirEnt_t*)malloc(sizeof(MFS_DirEnt_t) * blocks * DIR_ENTRIES);
+		MFS_Dir_t dir, first;
+		dir_clear(&first);
+		int count = 0, n = 1;
+		bmap_addrs(&ind, 0, blocks, addrs, 0);
+		for (int i = 0; i < blocks; i++)
+		{
+			if (addrs[i] == -1)
+				continue;
+			n = i + 1;
+			log_read(addrs[i], &dir, sizeof(MFS_Dir_t));
+			for (int j = 0; j < DIR_ENTRIES; j++)
+			{
+				if (i == 0 && j < 2)
+					first.entries[j] = dir.entries[j];
+				else if (dir.entries[j].inum != -1)
+					ents[count++] = dir.entries[j];
+			}
+		}
+		free(addrs);
+
+		while (n * DIR_ENTRIES < count * 2)
+			n++;
+		MFS_Dir_t *bucket = NULL;
+		int placed = -1;
+		while (placed < count)
+		{
+			bucket = (MFS_Dir_t*)realloc(bucket, sizeof(MFS_Dir_t) * n);
+			for (int b = 1; b < n; b++)
+				dir_clear(&bucket[b]);
+			bucket[0] = first;
+			for (placed = 0; placed < count; placed++)
+			{
+				int used, b = dir_bucket(ents[placed].name, n);
+				int slot = dir_free_slot(&bucket[b], &used);
+				if (slot == -1)
+					break;
+				bucket[b].entries[slot] = ents[placed];
+			}
+			if (placed < count)
+				n++;
+		}
+
+		bmap_t bm;
+		bmap_open(&bm, &ind);
+		for (int b = 0; b < n; b++)
+			bmap_set(&bm, b, log_append(&bucket[b], sizeof(MFS_Dir_t), SUM_DIR, inum), 1);
+		bmap_store(&bm, inum);
+		ind.size = n * MFS_BLOCK_SIZE;
+		inode_write(inum, &ind);
+		dirty_piece[inum / IMAP_ENTRIES] = 1;
+		free(bucket);
+		free(ents);
+	}
+	dir_v1 = 0;
+
+	for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
+	{
+		if (dirty_piece[i])
+			imap_flush_piece(i);
+	}
+	return 0;
+}
+
+// LOOKUP, LOOKUP_PATH, STAT and READ run on the reader threads against the snapshot
 int lfs_lookup(int pinum, char*filename)
 {
   if (inum_invalid(pinum))
@@ -66,52 +1803,33 @@ int lfs_lookup(int pinum, char*filename)
     return -1;
   }
 
-  int imp_index = pinum / IMAP_ENTRIES; // inode map piece number
-	int inode_index = pinum % IMAP_ENTRIES; // inode number (index) in imap piece
-  if (cr->imap[imp_index] == -1)
-  {
-    // perror("lookup: Invalid imap piece\n");
-  }
-  int imp_offset = cr->imap[imp_index]; // imap offset for lseek()
-  
-  lseek(fd, imp_offset, SEEK_SET);
-	MFS_Imap_t imp;
-  read(fd, &imp, sizeof(MFS_Imap_t));
-
-  int ind_offset = imp.inode_addr[inode_index]; // inode offset for lseek()
-  if (ind_offset == -1)
+  MFS_Inode_t ind; // inode
+  if (inode_read_snap(pinum, &ind) == -1)
   {
     // perror("LOOKUP: Invalid inode address\n");
     return -1;
   }
-  MFS_Inode_t ind; // inode
-  lseek(fd, ind_offset, SEEK_SET);
-  read(fd, &ind, sizeof(MFS_Inode_t));
   if (ind.type != MFS_DIRECTORY)
   {
     // perror("lookup: Not a directory\n");
     return -1;
   }
 
-  char db_buffer[MFS_BLOCK_SIZE]; // data block buffer
-  for (int i = 0; i < INODE_PTRS; i++)
+  // one bucket holds the name if the directory has it, searched where it
+  // lies when the image is mapped
+  MFS_Dir_t copy;
+  int addr;
+  if (bmap_addrs(&ind, dir_bucket(filename, dir_buckets(&ind)), 1, &addr, 1) == -1 || addr == -1)
+    return -1;
+  MFS_Dir_t *dir = (MFS_Dir_t*)io_map(addr, sizeof(MFS_Dir_t));
+  if (dir == NULL)
   {
-    int db_offset = ind.ptrs[i];
-    if (db_offset == -1)
-      continue;
-    
-    lseek(fd, db_offset, SEEK_SET);
-    read(fd, db_buffer, MFS_BLOCK_SIZE);
-
-    MFS_Dir_t *dir_buffer = (MFS_Dir_t *)db_buffer;
-    for (int j = 0; j < DIR_ENTRIES; j++)
-    {
-      MFS_DirEnt_t *entry = &dir_buffer->entries[j];
-      if (strcmp(entry->name, filename) == 0)
-        return entry->inum;
-    }
+    if (io_read(&copy, sizeof(MFS_Dir_t), addr) == -1)
+      return -1;
+    dir = &copy;
   }
-  return -1;
+  int slot = dir_slot(dir, filename);
+  return slot == -1 ? -1 : dir->entries[slot].inum;
 }
 
 int lfs_stat(int inum, MFS_Stat_t *stat)
@@ -126,213 +1844,322 @@ int lfs_stat(int inum, MFS_Stat_t *stat)
     return -1;
   }
 
-  int imp_index =inum / IMAP_ENTRIES;
-  if (cr->imap[imp_index] == -1)
-  {
-    // perror("stat: Invalid imap\n");
-    return -1;
-  }
-  
-  int imp_offset = cr->imap[imp_index];
-  lseek(fd, imp_offset, SEEK_SET);
-	MFS_Imap_t imp;
-  read(fd, &imp, sizeof(MFS_Imap_t));
-
-  int inode_num = inum % IMAP_ENTRIES; 
-  int ind_offset = imp.inode_addr[inode_num]; 
-  if (ind_offset == -1)
+  MFS_Inode_t ind; //inode
+  if (inode_read_snap(inum, &ind) == -1)
   {
     // perror("stat: Invalid inode address\n");
     return -1;
   }
 
-  MFS_Inode_t ind; //inode
-  lseek(fd, ind_offset, SEEK_SET);
-  read(fd, &ind, sizeof(MFS_Inode_t));
-
 	int type = ind.type;
   int size = ind.size;
 	stat->type = type;
   stat->size = size;
+  // a directory's size counts its buckets, which is nobody else's business;
+  // directories have always reported 0
+  if (type == MFS_DIRECTORY)
+    stat->size = 0;
 
   return 0;
 }
 
-int lfs_write(int inum, char*buffer, int db)
+// resolve a path one name at a time, all against the same snapshot, from
+// the root if it starts with '/'; empty names are skipped
+int lfs_lookup_path(int pinum, char *path, MFS_Stat_t *stat)
 {
-  if (inum_invalid(inum) || datablock_invalid(db))
-  {
-    // perror("write: Invalid inode number / data block\n");
-    return -1;
-  }
-  
-  
-  
-  int buf_index = 0;
-  char* temp = NULL;
-  char write_buffer[MFS_BLOCK_SIZE];
-  for (buf_index = 0, temp = buffer ; buf_index < MFS_BLOCK_SIZE; buf_index++)
+  int inum = path[0] == '/' ? 0 : pinum;
+  char name[29];
+  for (char *p = path; *p != '\0'; )
   {
-    if (temp == NULL)
+    int len = strcspn(p, "/");
+    if (len > 28)
     {
-      write_buffer[buf_index] = '\0';
+      // perror("lookup: name is too long\n");
+      return -1;
     }
-    else
+    if (len > 0)
     {
-      write_buffer[buf_index] = *temp;
-      temp++;
+      memcpy(name, p, len);
+      name[len] = '\0';
+      inum = lfs_lookup(inum, name);
+      if (inum == -1)
+        return -1;
     }
+    p += len;
+    if (*p == '/')
+      p++;
   }
+  if (lfs_stat(inum, stat) == -1)
+    return -1;
+  return inum;
+}
 
-  int imp_index = inum / IMAP_ENTRIES;
-  int imp_offset = cr->imap[imp_index];
-  int map_existed = 0;
-	int inode_num = 0;
-	MFS_Imap_t imp;
-	int ind_offset = -1;
-  if (imp_offset != -1)
+// write count blocks from db on, with one inode and one imap update for all
+int lfs_write_range(int inum, char*blocks, int db, int count)
+{
+  if (inum_invalid(inum) || count < 1 || datablock_invalid(db) || datablock_invalid(db + count - 1))
   {
-    map_existed = 1;
-
-    inode_num = inum % IMAP_ENTRIES; 
-    lseek(fd, imp_offset, SEEK_SET);
-    read(fd, &imp, sizeof(MFS_Imap_t));
-
-    ind_offset = imp.inode_addr[inode_num];
+    // perror("write: Invalid inode number / data block\n");
+    return -1;
   }
+
+  int imp_index = inum / IMAP_ENTRIES;
   
 	int node_existed = 0;
 	MFS_Inode_t ind;
-	int db_offset = -1;
-  if (ind_offset != -1 && map_existed)
+  if (inode_read(inum, &ind) != -1)
   {
     node_existed = 1;
-    lseek(fd, ind_offset, SEEK_SET);
-    read(fd, &ind, sizeof(MFS_Inode_t));
     if (ind.type != MFS_REGULAR_FILE)
     {
       // perror("write: Not a regular file\n");
       return -1;
     }
-    db_offset = ind.ptrs[db];
   }
 
-	int offset = cr->end;
-  if (db_offset != -1 && map_existed && node_existed)
-  {
-    offset = db_offset;
-  }
-
-  cr->end += MFS_BLOCK_SIZE;
-  lseek(fd, offset, SEEK_SET);
-  write(fd, write_buffer, MFS_BLOCK_SIZE);
-
   MFS_Inode_t new_node;
   MFS_Inode_t *new_node_ptr = &new_node;
   MFS_Inode_t *old_node_ptr = &ind;
   if (node_existed)
   {
-    new_node.size = (db + 1) * MFS_BLOCK_SIZE;
+    new_node.size = (db + count) * MFS_BLOCK_SIZE;
     new_node.type = ind.type;
 
 		copy_inode(new_node_ptr, old_node_ptr);
-    new_node.ptrs[db] = offset;   
   }
   else
   {
     new_node.size = 0;
     new_node.type = MFS_REGULAR_FILE;
 		create_empty_inode(new_node_ptr);
-    new_node.ptrs[db] = offset; 
   }
 
-  offset = cr->end;     
-  cr->end += sizeof(MFS_Inode_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &new_node, sizeof(MFS_Inode_t));
+  lease_revoke(inum);
+
+  // blocks appended back to back become one extent
+  bmap_t bm;
+  bmap_open(&bm, &new_node);
+  int run = -1, run_db = db, run_len = 0;
+  for (int i = 0; i < count; i++)
+  {
+    int offset = log_append(blocks + i * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE, SUM_DATA, inum);
+    if (run_len > 0 && offset == run + run_len * MFS_BLOCK_SIZE)
+    {
+      run_len++;
+      continue;
+    }
+    if (run_len > 0)
+      bmap_set(&bm, run_db, run, run_len);
+    run = offset;
+    run_db = db + i;
+    run_len = 1;
+  }
+  bmap_set(&bm, run_db, run, run_len);
+  bmap_store(&bm, inum);
+
+  inode_defer(inum, &new_node);
+  imap_defer(imp_index);
+  return 0;
+}
+
+// the block goes to the log straight from buffer, a NULL one writes zeros
+int lfs_write(int inum, char*buffer, int db)
+{
+  static char zeros[MFS_BLOCK_SIZE];
+  return lfs_write_range(inum, buffer == NULL ? zeros : buffer, db, 1);
+}
+
+// read count blocks from db on through one look at the inode, a run of
+// blocks that lies together in the log in one read; -1 unless every one of
+// them has been written
+int lfs_read_range(int inum, char* blocks, int db, int count)
+{
+  if (inum_invalid(inum) || count < 1 || datablock_invalid(db) || datablock_invalid(db + count - 1))
+  {
+    // perror("read: Invalid inode number / data block\n");
+    return -1;
+  }
+
+  MFS_Inode_t ind;
+  if (inode_read_snap(inum, &ind) == -1)
+  {
+    // perror("read: Invalid inode addr\n");
+    return -1;
+  }
+  
+  if (!(ind.type == MFS_DIRECTORY || ind.type == MFS_REGULAR_FILE))
+  {
+    // perror("read: Invalid inode type");
+    return -1;
+  }
+
+  int addrs[MFS_RANGE_MAX];
+  if (count > MFS_RANGE_MAX || bmap_addrs(&ind, db, count, addrs, 1) == -1)
+    return -1;
+  for (int i = 0; i < count; i++)
+  {
+    if (addrs[i] == -1)
+    {
+      // perror("read: Block not written\n");
+      return -1;
+    }
+  }
+
+  for (int i = 0, run = 1; i < count; i += run)
+  {
+    for (run = 1; i + run < count && addrs[i + run] == addrs[i] + run * MFS_BLOCK_SIZE; run++)
+      ;
+    if (io_read(blocks + i * MFS_BLOCK_SIZE, run * MFS_BLOCK_SIZE, addrs[i]) == -1)
+      return -1;
+  }
+
+  return 0;
+}
+
+int lfs_read(int inum, char* buffer, int db)
+{
+  return lfs_read_range(inum, buffer, db, 1);
+}
+
+// lfs_read for the readers when the image is mapped: *data is pointed at
+// the block where it lies in the mapping, or left NULL with the block read
+// into buffer where it is not mapped
+int lfs_read_map(int inum, char* buffer, char** data, int db)
+{
+  *data = NULL;
+  if (inum_invalid(inum) || datablock_invalid(db))
+    return -1;
 
-  MFS_Imap_t new_map;
-  MFS_Imap_t *new_map_ptr = &new_map;
-  MFS_Imap_t *old_map_ptr = &imp;
-  if (map_existed)
-  {
-		copy_imap(new_map_ptr, old_map_ptr);
-  }
-  else
-  {
-		create_empty_imap(new_map_ptr);
-  }
-	new_map.inode_addr[inode_num] = offset; 
+  MFS_Inode_t ind;
+  if (inode_read_snap(inum, &ind) == -1)
+    return -1;
+  if (!(ind.type == MFS_DIRECTORY || ind.type == MFS_REGULAR_FILE))
+    return -1;
 
-  offset = cr->end;
-  cr->end += sizeof(MFS_Imap_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &new_map, sizeof(MFS_Imap_t));
+  int addr;
+  if (bmap_addrs(&ind, db, 1, &addr, 1) == -1 || addr == -1)
+    return -1;
+  *data = io_map(addr, MFS_BLOCK_SIZE);
+  if (*data == NULL)
+    return io_read(buffer, MFS_BLOCK_SIZE, addr);
+  __atomic_add_fetch(&io_map_reads, 1, __ATOMIC_RELAXED);
+  return 0;
+}
 
-  cr->imap[imp_index] = offset; 
-  lseek(fd, 0, SEEK_SET);
-  write(fd, cr, sizeof(MFS_CR_t));
+int ra_init()
+{
+  if (ra_window <= 0)
+    return 0;
+  if (ra_window > MFS_RANGE_MAX - 1)
+    ra_window = MFS_RANGE_MAX - 1;
+  ra = (ra_t*)calloc(RA_STREAMS, sizeof(ra_t));
+  for (int i = 0; i < RA_STREAMS; i++)
+  {
+    ra[i].inum = -1;
+    ra[i].blocks = (char*)malloc((ra_window + 1) * MFS_BLOCK_SIZE);
+    pthread_mutex_init(&ra[i].lock, NULL);
+  }
+  return 0;
+}
 
-  fsync(fd);
+// forget the buffered blocks, counting those read ahead for nothing
+int ra_drop(ra_t *r)
+{
+  int unread = r->first + r->count - (r->next > r->first ? r->next : r->first);
+  if (r->count > 0 && unread > 0)
+    __atomic_add_fetch(&ra_wasted, unread, __ATOMIC_RELAXED);
+  r->count = 0;
   return 0;
 }
 
-int lfs_read(int inum, char* buffer, int db)
+// read db and what follows of it into the stream, stopping at the end of
+// the file or the first block never written; blocks read or -1
+int ra_fill(ra_t *r, int db)
 {
-  if (inum_invalid(inum) || datablock_invalid(db))
+  if (!r->pinned)
   {
-    // perror("read: Invalid inode number / data block\n");
-    return -1;
+    if (inode_read_snap(r->inum, &r->ind) == -1)
+      return -1;
+    r->pinned = 1;
   }
+  if (!(r->ind.type == MFS_DIRECTORY || r->ind.type == MFS_REGULAR_FILE))
+    return -1;
 
-  int imp_index = inum / IMAP_ENTRIES;
-  if (cr->imap[imp_index] == -1)
-  {
-    // perror("read: Invalid imap\n");
+  int n = ra_window + 1;
+  int end = (r->ind.size + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+  if (db + n > end)
+    n = end - db;
+  if (db + n > MFS_FILE_BLOCKS)
+    n = MFS_FILE_BLOCKS - db;
+  if (n < 1)
+    n = 1;
+
+  int addrs[MFS_RANGE_MAX];
+  if (bmap_addrs(&r->ind, db, n, addrs, 1) == -1 || addrs[0] == -1)
     return -1;
+  for (int i = 1; i < n; i++)
+  {
+    if (addrs[i] == -1)
+      n = i;
   }
 
-  int imp_offset = cr->imap[imp_index];
-  
-  lseek(fd, imp_offset, SEEK_SET);
-  MFS_Imap_t imp;
-  read(fd, &imp, sizeof(MFS_Imap_t));
-  
-  int inode_num = inum % IMAP_ENTRIES; 
-  int ind_offset = imp.inode_addr[inode_num];
-  if (ind_offset == -1)
+  for (int i = 0, run = 1; i < n; i += run)
   {
-    // perror("read: Invalid inode addr\n");
-    return -1;
+    for (run = 1; i + run < n && addrs[i + run] == addrs[i] + run * MFS_BLOCK_SIZE; run++)
+      ;
+    if (io_read(r->blocks + i * MFS_BLOCK_SIZE, run * MFS_BLOCK_SIZE, addrs[i]) == -1)
+      return -1;
   }
+  r->first = db;
+  r->count = n;
+  __atomic_add_fetch(&ra_fetched, n - 1, __ATOMIC_RELAXED);
+  return n;
+}
 
-  lseek(fd, ind_offset, SEEK_SET);
-  MFS_Inode_t ind;
-  read(fd, &ind, sizeof(MFS_Inode_t));
-  
-  if (!(ind.type == MFS_DIRECTORY || ind.type == MFS_REGULAR_FILE))
+// lfs_read for the readers, through the inode's readahead stream
+int lfs_read_ahead(int inum, char* buffer, int db)
+{
+  if (ra == NULL || inum_invalid(inum) || datablock_invalid(db))
+    return lfs_read(inum, buffer, db);
+
+  ra_t *r = &ra[inum % RA_STREAMS];
+  pthread_mutex_lock(&r->lock);
+  if (r->inum != inum || r->addr != snap_map[inum])
   {
-    // perror("read: Invalid inode type");
-    return -1;
+    ra_drop(r);
+    r->inum = inum;
+    r->addr = snap_map[inum];
+    r->next = -1;
+    r->pinned = 0;
+  }
+  if (r->count > 0 && db >= r->first && db < r->first + r->count)
+  {
+    memcpy(buffer, r->blocks + (db - r->first) * MFS_BLOCK_SIZE, MFS_BLOCK_SIZE);
+    if (db + 1 > r->next)
+      r->next = db + 1;
+    pthread_mutex_unlock(&r->lock);
+    __atomic_add_fetch(&ra_hits, 1, __ATOMIC_RELAXED);
+    return 0;
   }
 
-  int db_offset = ind.ptrs[db]; 
-  lseek(fd, db_offset, SEEK_SET);
-  read(fd, buffer, MFS_BLOCK_SIZE); 
-
-  return 0;
+  int sequential = db == r->next && r->addr != -1;
+  ra_drop(r);
+  r->next = db + 1;
+  int rc;
+  if (!sequential)
+    rc = lfs_read(inum, buffer, db);
+  else if ((rc = ra_fill(r, db)) > 0)
+  {
+    memcpy(buffer, r->blocks, MFS_BLOCK_SIZE);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&r->lock);
+  return rc;
 }
 
 int lfs_creat(int pinum, int type, char*name)
 {
-  int offset = 0;
   int imp_index = 0;
-  int map_existed = 0;
-  int inode_num = 0;
-
-  int imp_offset = -1, ind_offset = -1, db_offset = -1;
-
-  MFS_Imap_t imp;
 
   if (inum_invalid(pinum))
   {
@@ -351,225 +2178,41 @@ int lfs_creat(int pinum, int type, char*name)
     return -1;
   }
 
-  if (lfs_lookup(pinum, name) != -1)
-  {
-    return 0;
-  }
-
   imp_index = pinum / IMAP_ENTRIES; 
-  
-  inode_num = pinum % IMAP_ENTRIES; 
-  MFS_Imap_t imp_parent; // parent imap piece
-	imp_offset = cr->imap[imp_index];
-  if (imp_offset == -1)
-  {
-    // perror("creat: Invalid imap piece\n");
-    return -1;
-  }
-  lseek(fd, imp_offset, SEEK_SET);
-  read(fd, &imp_parent, sizeof(MFS_Imap_t));
-  ind_offset = imp_parent.inode_addr[inode_num]; 
-  if (ind_offset == -1)
+  MFS_Inode_t nd_par;
+  if (inode_read(pinum, &nd_par) == -1)
   {
     // perror("creat: Invalid inode address\n");
     return -1;
   }
 
-  MFS_Inode_t nd_par;
-  lseek(fd, ind_offset, SEEK_SET);
-  read(fd, &nd_par, sizeof(MFS_Inode_t));
-
   if (nd_par.type != MFS_DIRECTORY)
   {
     // perror("creat: Not a directory\n");
     return -1;
   }
 
-  int free_inum = -1;
-  int if_free_inum_found = 0;
-  for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
+  MFS_Dir_t dir_buf;
+  int block_par;
+  if (dir_find(&nd_par, name, &dir_buf, &block_par) != -1)
   {
-
-    imp_offset = cr->imap[i];
-
-    if (imp_offset != -1)
-    {
-      MFS_Imap_t imp_parent; 
-      lseek(fd, imp_offset, SEEK_SET);
-      read(fd, &imp_parent, sizeof(MFS_Imap_t));
-      for (int j = 0; j < IMAP_ENTRIES; j++)
-      {
-        ind_offset = imp_parent.inode_addr[j]; 
-
-        if (ind_offset == -1)
-        {
-					if_free_inum_found = 1;
-					int temp = i * IMAP_ENTRIES;
-          free_inum = temp + j; 
-          break;
-        }
-      }
-    }
-    else
-    {
-
-      MFS_Imap_t new_map;
-      for (int j = 0; j < IMAP_ENTRIES; j++)
-        new_map.inode_addr[j] = -1; 
-
-      offset = cr->end;
-      cr->end += sizeof(MFS_Imap_t);
-      lseek(fd, offset, SEEK_SET);
-      write(fd, &new_map, sizeof(MFS_Imap_t));
-
-      cr->imap[i] = offset;
-      lseek(fd, 0, SEEK_SET);
-      write(fd, cr, sizeof(MFS_CR_t));
-
-      fsync(fd);
-
-      for (int j = 0; j < IMAP_ENTRIES; j++)
-      {
-        ind_offset = new_map.inode_addr[j];
-        
-        if (ind_offset == -1)
-        {
-					if_free_inum_found = 1;
-					int temp = i * IMAP_ENTRIES;
-          free_inum = temp + j;
-          break;
-        }
-      }
-    }
-
-    if (if_free_inum_found)
-      break;
+    return 0;
   }
 
+  int free_inum = inum_alloc();
   if (free_inum == -1 || free_inum >= INODE_LIMIT)
   {
     // perror("creat: cannot find free inode");
     return -1;
   }
 
-  char data_buf[MFS_BLOCK_SIZE];
-  MFS_Dir_t *dir_buf = NULL;
-  int flag_found_entry = 0;
-  int block_par = 0;
-  MFS_Inode_t p_nd = nd_par;
-
-  for (int i = 0; i < INODE_PTRS; i++)
-  {
-		block_par = i;
-    db_offset = p_nd.ptrs[i]; 
-
-    if (db_offset == -1)
-    {
-      MFS_Dir_t *p_dir = (MFS_Dir_t *)data_buf;
-      for (i = 0; i < DIR_ENTRIES; i++)
-      {
-        strcpy(p_dir->entries[i].name, "\0");
-      }
-      for (i = 0; i < DIR_ENTRIES; i++)
-      {
-        p_dir->entries[i].inum = -1;
-      }
-      
-      offset = cr->end;
-      lseek(fd, offset, SEEK_SET);
-      write(fd, p_dir, sizeof(MFS_Dir_t));
-			cr->end += MFS_BLOCK_SIZE;
-
-      db_offset = offset;
-
-      MFS_Inode_t nd_dir_new;
-      nd_dir_new.size = nd_par.size;
-      nd_dir_new.type = MFS_DIRECTORY;
-
-			MFS_Inode_t *nd_dir_new_ptr = &nd_dir_new;
-			MFS_Inode_t *nd_dir_old_ptr = &nd_par;
-			copy_inode(nd_dir_new_ptr, nd_dir_old_ptr);
-
-      nd_dir_new.ptrs[block_par] = offset;
-      p_nd = nd_dir_new;
-
-      offset = cr->end;
-      cr->end += sizeof(MFS_Inode_t);
-      lseek(fd, offset, SEEK_SET);
-      write(fd, &nd_dir_new, sizeof(MFS_Inode_t));
-
-      MFS_Imap_t mp_dir_new;
-      MFS_Imap_t *mp_dir_new_ptr = &mp_dir_new;
-      MFS_Imap_t *mp_dir_old_ptr = &imp_parent;
-			copy_imap(mp_dir_new_ptr, mp_dir_old_ptr);
-      mp_dir_new.inode_addr[inode_num] = offset;
-
-      offset = cr->end;
-      
-      lseek(fd, offset, SEEK_SET);
-      write(fd, &mp_dir_new, sizeof(MFS_Imap_t));
-			cr->end += sizeof(MFS_Imap_t);
-			fsync(fd);
-
-      cr->imap[imp_index] = offset;
-      lseek(fd, 0, SEEK_SET);
-      write(fd, cr, sizeof(MFS_CR_t));
-      fsync(fd);
-    }
-		int ofst_size = db_offset;
-    lseek(fd, ofst_size, SEEK_SET);
-    read(fd, data_buf, MFS_BLOCK_SIZE);
-
-    dir_buf = (MFS_Dir_t *)data_buf;
-    for (int j = 0; j < DIR_ENTRIES; j++)
-    {
-      MFS_DirEnt_t *p_de = &dir_buf->entries[j];
-      if (p_de->inum == -1)
-      {	
-        flag_found_entry = 1;
-        int medium = free_inum;
-        strcpy(p_de->name, name);
-				p_de->inum = medium;
-        break;
-      }
-    }
-
-    if (flag_found_entry)
-      break;
-  }
-
-  offset = cr->end;
-  cr->end += MFS_BLOCK_SIZE;
-  lseek(fd, offset, SEEK_SET);
-  write(fd, dir_buf, sizeof(MFS_Dir_t));
-
-  MFS_Inode_t nd_par_new;
-  nd_par_new.size = p_nd.size;
-  nd_par_new.type = MFS_DIRECTORY;
-  for (int i = 0; i < INODE_PTRS; i++)
-    nd_par_new.ptrs[i] = p_nd.ptrs[i];
-  nd_par_new.ptrs[block_par] = offset;
-
-  offset = cr->end;
-  cr->end += sizeof(MFS_Inode_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &nd_par_new, sizeof(MFS_Inode_t));
-
-  MFS_Imap_t new_par_map;
-  MFS_Imap_t *new_pmap_ptr = &new_par_map;
-  MFS_Imap_t *old_pmap_ptr = &imp_parent;
-	copy_imap(new_pmap_ptr, old_pmap_ptr);
-  new_par_map.inode_addr[inode_num] = offset;
-
-  offset = cr->end;
-  cr->end += sizeof(MFS_Imap_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &new_par_map, sizeof(MFS_Imap_t));
-
-  cr->imap[imp_index] = offset;
-  lseek(fd, 0, SEEK_SET);
-  write(fd, cr, sizeof(MFS_CR_t));
-  fsync(fd);
+  lease_revoke(pinum);
+  lease_revoke(free_inum);
+  int rc = dir_add(pinum, &nd_par, name, free_inum);
+  inode_defer(pinum, &nd_par);
+  imap_defer(imp_index);
+  if (rc == -1)
+    return -1;
 
   char wr_buffer[MFS_BLOCK_SIZE];
   for (int i = 0; i < MFS_BLOCK_SIZE; i++)
@@ -578,7 +2221,12 @@ int lfs_creat(int pinum, int type, char*name)
   }
 
   int inum = free_inum;
-  map_existed = 0;
+
+  MFS_Inode_t new_node;
+  MFS_Inode_t *nnode_ptr = &new_node;
+  new_node.size = 0;
+  new_node.type = type;
+	create_empty_inode(nnode_ptr);
 
   if (type == MFS_DIRECTORY)
   {
@@ -596,304 +2244,743 @@ int lfs_creat(int pinum, int type, char*name)
       p_dir->entries[i].inum = -1;
     }
 
-    offset = cr->end; 
-    lseek(fd, offset, SEEK_SET);
-    write(fd, wr_buffer, MFS_BLOCK_SIZE);
+    MFS_Extent_t first = {0, log_append(wr_buffer, MFS_BLOCK_SIZE, SUM_DIR, inum), 1};
+    new_node.ext[0] = first;
+    new_node.nextents = 1;
+    new_node.size = MFS_BLOCK_SIZE;
   }
 
   imp_index = inum / IMAP_ENTRIES; 
-  imp_offset = cr->imap[imp_index];
-  if (imp_offset != -1)
+  inode_defer(inum, &new_node);
+  imap_defer(imp_index);
+  return 0;
+}
+
+// the inode the name left goes to victim, -1 if there was no such name
+int lfs_unlink(int pinum, char*name, int *victim)
+{
+  *victim = -1;
+  if (inum_invalid(pinum))
+  {
+    // perror("unlink: Invalid inode number\n");
+    return -1;
+  }
+
+  MFS_Inode_t ind_parent;
+  if (inode_read(pinum, &ind_parent) == -1)
   {
-		lseek(fd, imp_offset, SEEK_SET);
-    read(fd, &imp, sizeof(MFS_Imap_t));
-    map_existed = 1;
+    // perror("unlink: Invalid parent inode address\n");
+    return -1;
+  }
 
-    inode_num = inum % IMAP_ENTRIES;
-    ind_offset = imp.inode_addr[inode_num]; 
+  if (ind_parent.type != MFS_DIRECTORY)
+  {
+    // perror("unlink: Not a directory\n");
+    return -1;
   }
 
-  MFS_Inode_t new_node;
-  MFS_Inode_t *nnode_ptr = &new_node;
-  new_node.size = 0;
-  new_node.type = type;
-	create_empty_inode(nnode_ptr);
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+  {
+    // perror("unlink: Cannot unlink . or ..\n");
+    return -1;
+  }
 
-  if (type == MFS_DIRECTORY)
-    new_node.ptrs[0] = offset;
+  MFS_Dir_t dir_buffer;
+  int db_parent;
+  int entry_slot = dir_find(&ind_parent, name, &dir_buffer, &db_parent);
+  if (entry_slot == -1)
+  {
+    return 0;
+  }
+  int inum = dir_buffer.entries[entry_slot].inum;
+  *victim = inum;
+
+  int imp_index = inum / IMAP_ENTRIES;
+	MFS_Inode_t ind;
+  if (inode_read(inum, &ind) == -1)
+  {
+    // perror("unlink: Invalid inode address\n");
+    return -1;
+  }
+
+  if (ind.type == MFS_DIRECTORY && !dir_empty(&ind))
+  {
+    // perror("unlink: Directory is not empty\n");
+    return -1;
+  }
 
-  offset += MFS_BLOCK_SIZE;
-  cr->end += MFS_BLOCK_SIZE;
-  cr->end += sizeof(MFS_Inode_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &new_node, sizeof(MFS_Inode_t));
+  lease_revoke(inum);
+  lease_revoke(pinum);
+  inode_free(inum, &ind);
+  imap_defer(imp_index);
 
-  MFS_Imap_t new_map;
-  MFS_Imap_t *new_map_ptr = &new_map;
-  MFS_Imap_t *old_map_ptr = &imp;
-  if (map_existed)
+  // only the entry's bucket is rewritten, the directory keeps its size
+  imp_index = pinum / IMAP_ENTRIES;
+  MFS_DirEnt_t *entry = &dir_buffer.entries[entry_slot];
+  memset(entry->name, 0, 28);
+  entry->inum = -1;
+  dir_write(pinum, &ind_parent, db_parent, &dir_buffer);
+
+  inode_defer(pinum, &ind_parent);
+  imap_defer(imp_index);
+  return 0;
+}
+
+// close the open unit as a commit and write out the segment buffer
+int log_commit()
+{
+  inode_flush_deferred();
+  if (unit_hdr == -1 && log_uncommitted)
+    unit_open();
+  unit_close(SUM_COMMIT);
+  log_uncommitted = 0;
+  seg_flush();
+  commits++;
+  return 0;
+}
+
+int log_synced()
+{
+  sync_end = cr->end;
+  sync_seq = log_seq;
+  return 0;
+}
+
+// let the readers see everything committed so far
+int snap_publish()
+{
+  pthread_rwlock_wrlock(&snap_lock);
+  memcpy(snap_map, inode_map, sizeof(int) * INODE_LIMIT);
+  pthread_rwlock_unlock(&snap_lock);
+  return 0;
+}
+
+// make every update applied so far durable: one commit unit and one fsync.
+// The CR is left alone, recovery finds the commit by rolling forward from
+// the last checkpoint. -1 if the image failed a write or sync; the readers
+// keep the last snapshot that did make it.
+int lfs_commit()
+{
+  log_commit();
+  io_sync();
+  if (io_submit() == -1)
+    return -1;
+  log_synced();
+  snap_publish();
+  return 0;
+}
+
+// commit, then write the CR to the older slot so recovery starts from here.
+// The log and the CR share one fsync, the CR names the units that were not
+// yet synced before it and loading checks they made it. Segments only become
+// free for reuse once a durable checkpoint no longer reaches them.
+int lfs_checkpoint()
+{
+  if (io_failed)
+    return -1;
+  log_commit();
+  cr->magic = inode_v1 ? MFS_CR_MAGIC_V1 : dir_v1 ? MFS_CR_MAGIC_V2 : MFS_CR_MAGIC;
+  cr->seq = log_seq;
+  cr->gen++;
+  cr->verify_from = sync_end;
+  cr->verify_seq = sync_seq;
+  cr->seg_size = seg_size;
+  cr->checksum = log_checksum((char*)cr, offsetof(MFS_CR_t, checksum));
+  cr_slot = (cr_slot + 1) % MFS_CR_SLOTS;
+  static MFS_CR_t v3; // queued until io_submit
+  if (cr_v3)
   {
-		copy_imap(new_map_ptr, old_map_ptr);
+    memcpy(&v3, cr, sizeof(MFS_CR_t));
+    v3.seg_size = log_checksum((char*)cr, offsetof(MFS_CR_t, seg_size));
+    io_write(&v3, MFS_CR_V3_SIZE, cr_slot * MFS_CR_V3_SIZE);
   }
   else
+    io_write(cr, sizeof(MFS_CR_t), cr_slot * sizeof(MFS_CR_t));
+  io_sync();
+  if (io_submit() == -1)
+    return -1;
+  log_synced();
+  snap_publish();
+  seg_release();
+  ckpt_last = now_usec();
+  ckpt_log_mark = log_bytes;
+  checkpoints++;
+  return 0;
+}
+
+int checkpoint_due()
+{
+  if (log_bytes == ckpt_log_mark)
+    return 0;
+  return now_usec() - ckpt_last >= ckpt_interval * 1000000L ||
+      log_bytes - ckpt_log_mark >= (long)ckpt_log_mb << 20;
+}
+
+int overlaps(int addr, int len, int lo, int hi)
+{
+  return addr < hi && addr + len > lo;
+}
+
+// cost-benefit victim selection: the segment maximising (1 - u) * age / (1 + u),
+// -1 when no segment is sparse enough to be worth copying
+int clean_pick()
+{
+  int victim = -1;
+  double best = 0;
+  long now = now_usec();
+  for (int k = 0; k < seg_count; k++)
+  {
+    if (seg_state[k] != SEG_USED || seg_live[k] == 0)
+      continue;
+
+    double u = (double)seg_live[k] / ((k + 1) * seg_size - seg_start(k));
+    if (u * 100 > clean_max_util)
+      continue;
+    double age = (now - seg_mtime[k]) / 1e6 + 1;
+    double score = (1 - u) * age / (1 + u);
+    if (victim == -1 || score > best)
+    {
+      victim = k;
+      best = score;
+    }
+  }
+  return victim;
+}
+
+// copy every block, inode and imap piece still live in [lo, hi) to the log
+// tail; liveness comes from the current imap and inode pointers
+int clean_range(int lo, int hi)
+{
+  char dirty_piece[INODE_LIMIT / IMAP_ENTRIES];
+  memset(dirty_piece, 0, sizeof(dirty_piece));
+
+  char blk[MFS_BLOCK_SIZE];
+  MFS_Inode_t ind;
+  for (int inum = 0; inum < INODE_LIMIT; inum++)
   {
-		create_empty_imap(new_map_ptr);
+    if (inode_read(inum, &ind) == -1)
+      continue;
+
+    int moved = overlaps(inode_map[inum], sizeof(MFS_Inode_t), lo, hi);
+    bmap_t bm;
+    bmap_open(&bm, &ind);
+    if (ind.nextents == -1 && ind.index != -1 && overlaps(ind.index, sizeof(MFS_ExtIndex_t), lo, hi))
+      bm.index_dirty = moved = 1;
+    for (int k = 0; k < (ind.nextents == -1 ? BMAP_SPANS : 1); k++)
+    {
+      // moving blocks changes the extent list, work from a copy
+      MFS_Extent_t runs[EXT_SPAN];
+      MFS_Extent_t *ext;
+      if (ind.nextents == -1 && bm.span[k] != -1 && overlaps(bm.span[k], sizeof(MFS_ExtBlock_t), lo, hi))
+        bm.dirty[k] = moved = 1;
+      int n = bmap_span(&bm, k, &ext);
+      if (n == 0)
+        continue;
+      memcpy(runs, ext, sizeof(MFS_Extent_t) * n);
+
+      for (int i = 0; i < n; i++)
+      {
+        if (!overlaps(runs[i].addr, runs[i].len * MFS_BLOCK_SIZE, lo, hi))
+          continue;
+        for (int b = 0; b < runs[i].len; b++)
+        {
+          int addr = runs[i].addr + b * MFS_BLOCK_SIZE;
+          if (!overlaps(addr, MFS_BLOCK_SIZE, lo, hi))
+            continue;
+          log_read(addr, blk, MFS_BLOCK_SIZE);
+          int offset = log_append(blk, MFS_BLOCK_SIZE, ind.type == MFS_DIRECTORY ? SUM_DIR : SUM_DATA, inum);
+          bmap_set(&bm, runs[i].block + b, offset, 1);
+          clean_bytes += MFS_BLOCK_SIZE;
+          moved = 1;
+        }
+      }
+    }
+
+    if (moved)
+    {
+      bmap_store(&bm, inum);
+      inode_write(inum, &ind);
+      clean_bytes += sizeof(MFS_Inode_t);
+      dirty_piece[inum / IMAP_ENTRIES] = 1;
+    }
+    else
+      bmap_close(&bm);
   }
-	new_map.inode_addr[inode_num] = offset; 
 
-  offset = cr->end;
-  cr->end += sizeof(MFS_Imap_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &new_map, sizeof(MFS_Imap_t));
+  for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
+  {
+    if (dirty_piece[i] || (cr->imap[i] != -1 && overlaps(cr->imap[i], sizeof(MFS_Imap_t), lo, hi)))
+    {
+      imap_flush_piece(i);
+      clean_bytes += sizeof(MFS_Imap_t);
+    }
+  }
+  return 0;
+}
 
-  cr->imap[imp_index] = offset; 
-  lseek(fd, 0, SEEK_SET);
-  write(fd, cr, sizeof(MFS_CR_t));
-  fsync(fd);
+int clean_segment(int v)
+{
+  clean_range(v * seg_size, seg_end(v));
+  segs_cleaned++;
   return 0;
 }
 
-int lfs_unlink(int pinum, char*name)
+// clean up to max_segs victims, checkpointed so they are free for reuse
+int cleaner_run(int max_segs)
 {
-  if (inum_invalid(pinum))
+  if (io_failed)
+    return 0;
+  long start = now_usec();
+  int cleaned = 0;
+  inode_flush_deferred(); // the cleaner works from the inodes in the log
+  while (cleaned < max_segs)
   {
-    // perror("unlink: Invalid inode number\n");
+    int v = clean_pick();
+    if (v == -1)
+      break;
+    clean_segment(v);
+    cleaned++;
+  }
+
+  if (cleaned > 0)
+    lfs_checkpoint();
+  clean_usec += now_usec() - start;
+  return cleaned;
+}
+
+int drc_init()
+{
+  if (drc_size <= 0)
+    return 0;
+  drc = (drc_ent_t*)malloc(sizeof(drc_ent_t) * drc_size);
+  for (int i = 0; i < drc_size; i++)
+    drc[i].seq = -1;
+  return 0;
+}
+
+drc_ent_t *drc_slot(struct sockaddr_in *sock, int seq)
+{
+  unsigned int h = 2166136261u;
+  h = (h ^ sock->sin_addr.s_addr) * 16777619u;
+  h = (h ^ sock->sin_port) * 16777619u;
+  h = (h ^ (unsigned int)seq) * 16777619u;
+  return &drc[h % drc_size];
+}
+
+// the cached result of this very request, NULL if it has not been seen
+drc_ent_t *drc_find(struct sockaddr_in *sock, MFS_MSG_t *msg)
+{
+  if (drc == NULL)
+    return NULL;
+  drc_ent_t *e = drc_slot(sock, msg->seq);
+  if (e->seq != msg->seq || e->req != msg->req || e->sock.sin_port != sock->sin_port ||
+      e->sock.sin_addr.s_addr != sock->sin_addr.s_addr)
+    return NULL;
+  return e;
+}
+
+int drc_insert(struct sockaddr_in *sock, MFS_MSG_t *msg, int inum)
+{
+  if (drc == NULL || msg->seq == -1)
+    return 0;
+  drc_ent_t *e = drc_slot(sock, msg->seq);
+  e->sock = *sock;
+  e->seq = msg->seq;
+  e->req = msg->req;
+  e->inum = inum;
+  e->batch = batch_seq;
+  e->hold = lease_hold;
+  return 0;
+}
+
+// unpack a request datagram, -1 if it is not a well formed request in the
+// wire version we speak. Otherwise returns which part of a WRITEV range the
+// datagram is, 0 for everything else. The block of a WRITE or WRITEV part
+// is left where it lies in buf, msg->data points at it
+int msg_decode(char *buf, int n, MFS_MSG_t *msg)
+{
+  MFS_WireHdr_t hdr;
+  if (n < sizeof(MFS_WireHdr_t))
+    return -1;
+  memcpy(&hdr, buf, sizeof(MFS_WireHdr_t));
+  if (hdr.magic != MFS_WIRE_MAGIC || hdr.version != MFS_WIRE_VERSION)
+    return -1;
+  if (hdr.len < 0 || hdr.len != n - sizeof(MFS_WireHdr_t))
     return -1;
-  }
 
-  int inum = lfs_lookup(pinum, name);
-  if (inum == -1)
+  char *payload = buf + sizeof(MFS_WireHdr_t);
+  msg->req = hdr.req;
+  msg->seq = hdr.seq;
+  msg->inum = hdr.inum;
+  msg->block = hdr.arg;
+  msg->stat.type = hdr.arg;
+  msg->lease = 0;
+  msg->data = NULL;
+  if (hdr.req == LOOKUP || hdr.req == CREAT || hdr.req == UNLINK)
   {
-    return 0;
+    if (hdr.len > 28)
+      return -1;
+    memset(msg->name, 0, 28);
+    memcpy(msg->name, payload, hdr.len);
+    msg->buffer[0] = '\0'; // a 28 byte name runs on into buffer
   }
-
-  int imp_index = inum / IMAP_ENTRIES;
-	int imp_offset = cr->imap[imp_index];
-  if (imp_offset == -1)
+  else if (hdr.req == LOOKUP_PATH)
   {
-    // perror("unlink: Invalid imap\n");
-    return -1;
+    if (hdr.len > MFS_PATH_MAX)
+      return -1;
+    memcpy(msg->buffer, payload, hdr.len);
+    msg->buffer[hdr.len] = '\0';
   }
-
-	MFS_Imap_t imp;
-  int inode_num = inum % IMAP_ENTRIES; 
-  lseek(fd, imp_offset, SEEK_SET);
-  read(fd, &imp, sizeof(MFS_Imap_t));
-  int ind_offset = imp.inode_addr[inode_num];
-  if (ind_offset == -1)
+  else if (hdr.req == WRITE)
   {
-    // perror("unlink: Invalid inode address\n");
-    return -1;
+    if (hdr.len != MFS_BLOCK_SIZE)
+      return -1;
+    msg->data = payload;
   }
-
-	MFS_Inode_t ind;
-  lseek(fd, ind_offset, SEEK_SET);
-  read(fd, &ind, sizeof(MFS_Inode_t));
-
-  if (ind.type == MFS_DIRECTORY)
+  else if (hdr.req == READ && hdr.len > 0)
   {
-    char data_buffer[MFS_BLOCK_SIZE];
-    for (int i = 0; i < INODE_PTRS; i++)
-    {
-      int db_offset = ind.ptrs[i];
-      if (db_offset == -1)
-        continue;
-
-      lseek(fd, db_offset, SEEK_SET);
-      read(fd, data_buffer, MFS_BLOCK_SIZE);
-
-      MFS_Dir_t *dir_buffer = (MFS_Dir_t *)data_buffer;
-      for (int j = 0; j < DIR_ENTRIES; j++)
-      {
-        MFS_DirEnt_t *entry = &dir_buffer->entries[j];
-        if (entry->inum != pinum && entry->inum != inum && entry->inum != -1)
-        {
-          // perror("unlink: Directory is not empty\n");
-          return -1;
-        }
-      }
-    }
+    if (hdr.len != sizeof(int))
+      return -1;
+    memcpy(&msg->lease, payload, sizeof(int));
   }
-
-  MFS_Imap_t new_imp;
-  MFS_Imap_t *new_map_ptr = &new_imp;
-  MFS_Imap_t *old_map_ptr = &imp;
-		copy_imap(new_map_ptr, old_map_ptr);
-	new_imp.inode_addr[inode_num] = -1; 
-
-  int if_new_imp_empty = 1;
-  for (int i = 0; i < IMAP_ENTRIES; i++)
+  else if (hdr.req == READV || hdr.req == WRITEV)
   {
-		int ad = new_imp.inode_addr[i];
-    if (ad != -1)
+    MFS_WireRange_t range;
+    if (hdr.req == READV && hdr.len == sizeof(MFS_WireRange_t) + sizeof(int))
+      memcpy(&msg->lease, payload + sizeof(MFS_WireRange_t), sizeof(int));
+    else if (hdr.len != sizeof(MFS_WireRange_t) + (hdr.req == WRITEV ? MFS_BLOCK_SIZE : 0))
+      return -1;
+    memcpy(&range, payload, sizeof(MFS_WireRange_t));
+    if (range.count < 1 || range.count > MFS_RANGE_MAX)
+      return -1;
+    msg->block = range.first;
+    msg->count = range.count;
+    msg->blocks = NULL;
+    if (hdr.req == WRITEV)
     {
-      if_new_imp_empty = 0;
-      break;
+      int part = hdr.arg - range.first;
+      if (part < 0 || part >= range.count)
+        return -1;
+      msg->data = payload + sizeof(MFS_WireRange_t);
+      return part;
     }
   }
+  return 0;
+}
 
-	int offset = -1;
-  if (!if_new_imp_empty)
+// a READV reply: one datagram per block of the range, sent as a burst
+int reply_send_range(int sd, struct sockaddr_in *sock, MFS_MSG_t *msg)
+{
+  MFS_WireHdr_t hdr[MFS_RANGE_MAX];
+  MFS_WireRange_t range;
+  struct iovec iov[MFS_RANGE_MAX * 4];
+  range.first = msg->block;
+  range.count = msg->count;
+  int trailer = msg->lease > 0 ? sizeof(int) : 0;
+  for (int i = 0; i < msg->count; i++)
   {
-		offset = cr->end;
-    cr->end += sizeof(MFS_Imap_t);
-    lseek(fd, offset, SEEK_SET);
-    write(fd, &new_imp, sizeof(MFS_Imap_t));
-
-    cr->imap[imp_index] = offset;
+    hdr[i].magic = MFS_WIRE_MAGIC;
+    hdr[i].version = MFS_WIRE_VERSION;
+    hdr[i].req = RESPONSE;
+    hdr[i].seq = msg->seq;
+    hdr[i].inum = msg->inum;
+    hdr[i].arg = msg->block + i;
+    hdr[i].len = sizeof(MFS_WireRange_t) + MFS_BLOCK_SIZE + trailer;
+    iov[i * 4].iov_base = &hdr[i];
+    iov[i * 4].iov_len = sizeof(MFS_WireHdr_t);
+    iov[i * 4 + 1].iov_base = &range;
+    iov[i * 4 + 1].iov_len = sizeof(MFS_WireRange_t);
+    iov[i * 4 + 2].iov_base = msg->blocks + i * MFS_BLOCK_SIZE;
+    iov[i * 4 + 2].iov_len = MFS_BLOCK_SIZE;
+    iov[i * 4 + 3].iov_base = &msg->lease;
+    iov[i * 4 + 3].iov_len = trailer;
   }
-  if(if_new_imp_empty)
+  return UDP_WriteBurst(sd, sock, iov, 4, msg->count);
+}
+
+// send the reply to a request; msg->req is the request being answered,
+// which decides the payload
+int reply_send(int sd, struct sockaddr_in *sock, MFS_MSG_t *msg)
+{
+  if (msg->req == READV && msg->inum >= 0)
+    return reply_send_range(sd, sock, msg);
+
+  MFS_WireHdr_t hdr;
+  struct iovec iov[2];
+  hdr.magic = MFS_WIRE_MAGIC;
+  hdr.version = MFS_WIRE_VERSION;
+  hdr.req = RESPONSE;
+  hdr.seq = msg->seq;
+  hdr.inum = msg->inum;
+  hdr.arg = 0;
+  hdr.len = 0;
+  // the payload is gathered from where it lies, the block of a READ
+  // straight from the image mapping when it was read there
+  iov[1].iov_base = NULL;
+  if (msg->req == READ && msg->inum >= 0)
   {
-    cr->imap[imp_index] = -1;
+    hdr.arg = msg->lease;
+    hdr.len = MFS_BLOCK_SIZE;
+    iov[1].iov_base = msg->data != NULL ? msg->data : msg->buffer;
   }
-	lseek(fd, 0, SEEK_SET);
-  write(fd, cr, sizeof(MFS_CR_t));
-  fsync(fd);
-
-  imp_index = pinum / IMAP_ENTRIES;
-  int imp_p_offset = cr->imap[imp_index];
-  if (imp_p_offset == -1)
+  else if ((msg->req == STAT || msg->req == LOOKUP_PATH) && msg->inum >= 0)
   {
-    // perror("unlink: Invalid parent imap\n");
-    return -1;
+    hdr.len = sizeof(MFS_Stat_t);
+    iov[1].iov_base = &msg->stat;
   }
+  else if (msg->req == UNLINK && msg->inum >= 0)
+    hdr.arg = msg->block;
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(MFS_WireHdr_t);
+  iov[1].iov_len = hdr.len;
+  return UDP_WriteBurst(sd, sock, iov, 2, 1) == 1 ? 0 : -1;
+}
 
-  inode_num = pinum % IMAP_ENTRIES;
-  MFS_Imap_t imp_parent;
-  lseek(fd, imp_p_offset, SEEK_SET);
-  read(fd, &imp_parent, sizeof(MFS_Imap_t));
-  int ind_p_offset = imp_parent.inode_addr[inode_num];
-  if (ind_p_offset == -1)
+// send the held back replies whose leases have run out; usec until the
+// next one is due, -1 once none is left
+long held_flush(int sd)
+{
+  long now = lease_now(), next = -1;
+  int kept = 0;
+  for (int i = 0; i < held_cnt; i++)
   {
-    // perror("unlink: Invalid parent inode address\n");
-    return -1;
+    if (held[i].hold <= now)
+    {
+      reply_send(sd, &held[i].sock, &held[i].msg);
+      continue;
+    }
+    if (next == -1 || held[i].hold - now < next)
+      next = held[i].hold - now;
+    held[kept++] = held[i];
   }
+  held_cnt = kept;
+  return next;
+}
 
-  MFS_Inode_t ind_parent;
-  lseek(fd, ind_p_offset, SEEK_SET);
-  read(fd, &ind_parent, sizeof(MFS_Inode_t));
-
-  if (ind_parent.type != MFS_DIRECTORY)
+int batch_flush(int sd)
+{
+  // a batch that did not make it to the image fails as a whole, and its
+  // requests must not be answered with their results when retransmitted
+  if (batch_dirty && lfs_commit() == -1)
   {
-    // perror("unlink: Not a directory\n");
-    return -1;
+    for (int i = 0; i < pending_cnt; i++)
+    {
+      pending[i].msg.inum = -1;
+      drc_ent_t *e = drc_find(&pending[i].sock, &pending[i].msg);
+      if (e != NULL)
+        e->inum = -1;
+    }
   }
-
-  char data_buffer[MFS_BLOCK_SIZE];
-  MFS_Dir_t *dir_buffer = NULL;
-  int entry_found = 0;
-  int db_parent = 0;
-  for (int i = 0; i < INODE_PTRS; i++)
+  // the batch is published, its inodes can be leased again
+  pthread_mutex_lock(&lease_lock);
+  lease_epoch++;
+  pthread_mutex_unlock(&lease_lock);
+  long now = lease_now();
+  for (int i = 0; i < pending_cnt; i++)
   {
-
-    int db_p_offset = ind_parent.ptrs[i];
-    if (db_p_offset == -1)
+    if (pending[i].hold <= now)
+    {
+      reply_send(sd, &pending[i].sock, &pending[i].msg);
       continue;
-    db_parent = i;
-    lseek(fd, db_p_offset, SEEK_SET);
-    read(fd, data_buffer, MFS_BLOCK_SIZE);
-
-    dir_buffer = (MFS_Dir_t *)data_buffer;
-    for (int j = 0; j < DIR_ENTRIES; j++)
+    }
+    if (held_cnt == held_cap)
     {
-      MFS_DirEnt_t *entry = &dir_buffer->entries[j];
-      if (entry->inum == inum)
-      {
-				entry_found = 1;
-        
-        strcpy(entry->name, "\0");
-        entry->inum = -1;
-        break;
-      }
+      held_cap = held_cap ? held_cap * 2 : commit_batch;
+      held = (pending_t*)realloc(held, sizeof(pending_t) * held_cap);
     }
-
-    if (entry_found)
-      break;
+    held[held_cnt++] = pending[i];
+    leases_held++;
   }
+  pending_cnt = 0;
+  batch_dirty = 0;
+  batch_seq++;
+  if (io_failed)
+    return -1;
 
-  if (!entry_found)
+  // the log is about to outgrow the image, reclaim space before it does;
+  // dead segments only need a checkpoint, the rest need cleaning first
+  if (seg_free_count() < clean_min_free)
   {
-    return 0;
+    if (seg_dead_count() > 0)
+      lfs_checkpoint();
+    else
+      cleaner_run(1);
   }
+  if (checkpoint_due())
+    lfs_checkpoint();
+  return 0;
+}
 
-  offset = cr->end;
-  cr->end += MFS_BLOCK_SIZE;
-  lseek(fd, offset, SEEK_SET);
-  write(fd, dir_buffer, sizeof(MFS_Dir_t));
-
-  MFS_Inode_t new_ind_parent;
-  MFS_Inode_t *new_ind_parent_ptr = &new_ind_parent;
-  MFS_Inode_t *old_ind_parent_ptr = &ind_parent;
-	int determinant = ind_parent.size - MFS_BLOCK_SIZE;
-	if (determinant > 0){
-		new_ind_parent.size = ind_parent.size - MFS_BLOCK_SIZE;
-	} else {
-		new_ind_parent.size = 0;
-	}
-
-  new_ind_parent.type = MFS_DIRECTORY;
-	copy_inode(new_ind_parent_ptr, old_ind_parent_ptr);
-  new_ind_parent.ptrs[db_parent] = offset;
-
-  offset = cr->end;
-  cr->end += sizeof(MFS_Inode_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &new_ind_parent, sizeof(MFS_Inode_t));
-
-  MFS_Imap_t new_imp_parent;
-  MFS_Imap_t *new_pimp_ptr = &new_imp_parent;
-  MFS_Imap_t *old_pimp_ptr = &imp_parent;
-	copy_imap(new_pimp_ptr, old_pimp_ptr);
-  new_imp_parent.inode_addr[inode_num] = offset;
-
-  offset = cr->end;
-  cr->end += sizeof(MFS_Imap_t);
-  lseek(fd, offset, SEEK_SET);
-  write(fd, &new_imp_parent, sizeof(MFS_Imap_t));
-
-  cr->imap[imp_index] = offset;
-  lseek(fd, 0, SEEK_SET);
-  write(fd, cr, sizeof(MFS_CR_t));
-  fsync(fd);
+// hold a reply back until the open batch has been committed
+int batch_reply(int sd, struct sockaddr_in *sock, MFS_MSG_t *msg)
+{
+  batch_dirty = 1;
+  commit_reqs++;
+
+  if (pending_cnt == 0)
+    batch_deadline = now_usec() + commit_window;
+  // the writer's replies are the header alone, only what it says is kept
+  pending[pending_cnt].sock = *sock;
+  pending[pending_cnt].msg.req = msg->req;
+  pending[pending_cnt].msg.seq = msg->seq;
+  pending[pending_cnt].msg.inum = msg->inum;
+  pending[pending_cnt].msg.block = msg->block;
+  pending[pending_cnt].hold = lease_hold;
+  pending_cnt++;
+
+  if (commit_window == 0 || pending_cnt >= commit_batch)
+    batch_flush(sd);
+  return 0;
+}
+
+// the readers are still running, what they count is read under their
+// locks or atomically
+int lfs_print_stats()
+{
+  pthread_mutex_lock(&icache_lock);
+  fprintf(stderr, "inode cache: %ld hits, %ld misses (%d/%d entries)\n",
+      icache_hits, icache_misses, icache_used, icache_size);
+  pthread_mutex_unlock(&icache_lock);
+  fprintf(stderr, "group commit: %ld mutating requests in %ld commits\n",
+      commit_reqs, commits);
+  fprintf(stderr, "write coalescing: %ld inode updates in %ld versions, %ld imap updates in %ld pieces\n",
+      inode_updates, inode_versions, imap_updates, imap_versions);
+  fprintf(stderr, "readers: %d threads served %ld requests\n",
+      reader_threads, __atomic_load_n(&reads_served, __ATOMIC_RELAXED));
+  fprintf(stderr, "readahead: %ld blocks read ahead, %ld READs served from them, %ld never asked for\n",
+      __atomic_load_n(&ra_fetched, __ATOMIC_RELAXED), __atomic_load_n(&ra_hits, __ATOMIC_RELAXED),
+      __atomic_load_n(&ra_wasted, __ATOMIC_RELAXED));
+  pthread_mutex_lock(&lease_lock);
+  fprintf(stderr, "leases: %ld granted, %ld replies held back until they ran out\n",
+      leases_granted, leases_held);
+  pthread_mutex_unlock(&lease_lock);
+  fprintf(stderr, "duplicate cache: %ld replies replayed, %ld retransmissions of pending requests dropped\n",
+      drc_replays, drc_drops);
+  fprintf(stderr, "segment writer: %ld flushes of a %d byte buffer, %d/%d segments free\n",
+      seg_flushes, seg_size, seg_free_count(), seg_count);
+  double amplification = log_bytes > clean_bytes ? (double)log_bytes / (log_bytes - clean_bytes) : 1;
+  fprintf(stderr, "checkpoints: %ld\n", checkpoints);
+  fprintf(stderr, "io: %s, %ld submits for %ld writes and syncs, %ld reads from the mapping\n",
+      io_backend == IO_URING ? "io_uring" : "pread/pwrite", io_submits, io_ops,
+      __atomic_load_n(&io_map_reads, __ATOMIC_RELAXED));
+  fprintf(stderr, "cleaner: %ld segments cleaned, %ld bytes copied, write amplification %.2f, %ld ms spent\n",
+      segs_cleaned, clean_bytes, amplification, clean_usec / 1000);
   return 0;
 }
 
 int lfs_shutdown()
 {
-  fsync(fd);
+  lfs_checkpoint();
+  lfs_print_stats();
   exit(0);
 }
 
-int request_type (int sd, struct sockaddr_in sock, MFS_MSG_t msg_sd, MFS_MSG_t msg_rc) 
+int request_readonly(int req)
+{
+  return req == LOOKUP || req == LOOKUP_PATH || req == STAT || req == READ || req == READV;
+}
+
+// called by the readers for LOOKUP, LOOKUP_PATH, STAT, READ and READV, by
+// the writer for the rest. msg_rc is the caller's to reuse for every
+// request, a READV reply is read into the msg_rc->blocks it provides
+int request_type(int sd, struct sockaddr_in *sock, MFS_MSG_t *msg_sd, MFS_MSG_t *msg_rc)
 {
-  if (msg_sd.req == LOOKUP)
+  msg_rc->seq = msg_sd->seq;
+  msg_rc->req = msg_sd->req;
+  msg_rc->data = NULL;
+  if (request_readonly(msg_sd->req))
+  {
+    pthread_rwlock_rdlock(&snap_lock);
+    if (msg_sd->req == LOOKUP)
+    {
+      msg_rc->inum = lfs_lookup(msg_sd->inum, msg_sd->name);
+    }
+    else if (msg_sd->req == LOOKUP_PATH)
+    {
+      msg_rc->inum = lfs_lookup_path(msg_sd->inum, msg_sd->buffer, &(msg_rc->stat));
+    }
+    else if (msg_sd->req == STAT)
+    {
+      msg_rc->inum = lfs_stat(msg_sd->inum, &(msg_rc->stat));
+    }
+    else if (msg_sd->req == READV)
+    {
+      msg_rc->block = msg_sd->block;
+      msg_rc->count = msg_sd->count;
+      msg_rc->inum = lfs_read_range(msg_sd->inum, msg_rc->blocks, msg_sd->block, msg_sd->count);
+      msg_rc->lease = msg_rc->inum >= 0 ? lease_grant(msg_sd->inum, msg_sd->lease, sock) : 0;
+    }
+    else
+    {
+      if (io_map_base != NULL)
+        msg_rc->inum = lfs_read_map(msg_sd->inum, msg_rc->buffer, &msg_rc->data, msg_sd->block);
+      else
+        msg_rc->inum = lfs_read_ahead(msg_sd->inum, msg_rc->buffer, msg_sd->block);
+      msg_rc->lease = msg_rc->inum >= 0 ? lease_grant(msg_sd->inum, msg_sd->lease, sock) : 0;
+    }
+
+    // a block sent from the mapping is only safe from segment reuse while
+    // snap_lock is held
+    if (msg_rc->data == NULL)
+      pthread_rwlock_unlock(&snap_lock);
+    reply_send(sd, sock, msg_rc);
+    if (msg_rc->data != NULL)
+      pthread_rwlock_unlock(&snap_lock);
+    return 0;
+  }
+
+    // a retransmission: answer it again once its batch is committed and
+    // the leases it ended have run out, the reply still pending or held
+    // back covers it otherwise
+    drc_ent_t *dup = drc_find(sock, msg_sd);
+    if (dup != NULL)
     {
-      msg_rc.inum = lfs_lookup(msg_sd.inum, msg_sd.name);
+      if (dup->batch == batch_seq || dup->hold > lease_now())
+      {
+        drc_drops++;
+        return 0;
+      }
+      drc_replays++;
+      msg_rc->inum = dup->inum;
+      msg_rc->block = 0; // which inode an UNLINK removed is not kept
+      reply_send(sd, sock, msg_rc);
+      return 0;
     }
-    else if (msg_sd.req == STAT)
+
+    // the image failed a write: what the log holds past it cannot be read
+    // back or made durable, updates are refused from now on
+    if (io_failed && msg_sd->req != SHUTDOWN)
     {
-      msg_rc.inum = lfs_stat(msg_sd.inum, &(msg_rc.stat));
+      msg_rc->inum = -1;
+      reply_send(sd, sock, msg_rc);
+      return 0;
     }
-    else if (msg_sd.req == WRITE)
+
+    lease_hold = 0;
+    lease_client = *sock;
+    if (msg_sd->req == WRITE)
     {
-      msg_rc.inum = lfs_write(msg_sd.inum, msg_sd.buffer, msg_sd.block);
+      msg_rc->inum = lfs_write(msg_sd->inum, msg_sd->data, msg_sd->block);
     }
-    else if (msg_sd.req == READ)
+    else if (msg_sd->req == WRITEV)
     {
-      msg_rc.inum = lfs_read(msg_sd.inum, msg_rc.buffer, msg_sd.block);
+      msg_rc->inum = lfs_write_range(msg_sd->inum, msg_sd->blocks, msg_sd->block, msg_sd->count);
     }
-    else if (msg_sd.req == CREAT)
+    else if (msg_sd->req == CREAT)
     {
-      msg_rc.inum = lfs_creat(msg_sd.inum, msg_sd.stat.type, msg_sd.name);
+      msg_rc->inum = lfs_creat(msg_sd->inum, msg_sd->stat.type, msg_sd->name);
     }
-    else if (msg_sd.req == UNLINK)
+    else if (msg_sd->req == UNLINK)
     {
-      msg_rc.inum = lfs_unlink(msg_sd.inum, msg_sd.name);
+      msg_rc->inum = lfs_unlink(msg_sd->inum, msg_sd->name, &msg_rc->block);
     }
-    else if (msg_sd.req == SHUTDOWN)
+    else if (msg_sd->req == SHUTDOWN)
     {
-      msg_rc.req = RESPONSE;
-      UDP_Write(sd, &sock, (char*)&msg_rc, sizeof(MFS_MSG_t));
+      batch_flush(sd);
+      for (long next = held_flush(sd); next >= 0; next = held_flush(sd))
+        usleep(next);
+      msg_rc->inum = io_failed ? -1 : 0;
+      reply_send(sd, sock, msg_rc);
       lfs_shutdown();
       return 0;
     }
@@ -903,9 +2990,310 @@ int request_type (int sd, struct sockaddr_in sock, MFS_MSG_t msg_sd, MFS_MSG_t m
       return -1;
     }
 
-    msg_rc.req = RESPONSE;
-    UDP_Write(sd, &sock, (char*)&msg_rc, sizeof(MFS_MSG_t));
+    drc_insert(sock, msg_sd, msg_rc->inum);
+    batch_reply(sd, sock, msg_rc);
+    return 0;
+}
+
+int reqq_init(reqq_t *q)
+{
+  q->items = (pending_t**)malloc(sizeof(pending_t*) * REQQ_CAP);
+  q->cap = REQQ_CAP;
+  q->head = 0;
+  q->count = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->nonempty, NULL);
+  pthread_cond_init(&q->nonfull, NULL);
+  return 0;
+}
+
+int reqq_push(reqq_t *q, pending_t *req)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->cap)
+    pthread_cond_wait(&q->nonfull, &q->lock);
+  q->items[(q->head + q->count) % q->cap] = req;
+  q->count++;
+  pthread_cond_signal(&q->nonempty);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+// take the oldest request, waiting at most timeout usec (forever when
+// negative); NULL if none came in time
+pending_t *reqq_pop(reqq_t *q, long timeout)
+{
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  long nsec = until.tv_nsec + (timeout % 1000000L) * 1000;
+  until.tv_sec += timeout / 1000000L + nsec / 1000000000L;
+  until.tv_nsec = nsec % 1000000000L;
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0)
+  {
+    if (timeout < 0)
+      pthread_cond_wait(&q->nonempty, &q->lock);
+    else if (pthread_cond_timedwait(&q->nonempty, &q->lock, &until) != 0 && q->count == 0)
+    {
+      pthread_mutex_unlock(&q->lock);
+      return NULL;
+    }
+  }
+  pending_t *req = q->items[q->head];
+  q->head = (q->head + 1) % q->cap;
+  q->count--;
+  pthread_cond_signal(&q->nonfull);
+  pthread_mutex_unlock(&q->lock);
+  return req;
+}
+
+int pool_init()
+{
+  int size = 2 * REQQ_CAP + reader_threads + 1 + UDP_BURST;
+  pool = (pending_t**)malloc(sizeof(pending_t*) * size);
+  for (int i = 0; i < size; i++)
+  {
+    pool[i] = (pending_t*)malloc(sizeof(pending_t));
+    if (posix_memalign((void**)&pool[i]->wire, 64, MFS_WIRE_MAX) != 0)
+      return -1;
+  }
+  pool_free = size;
+  return 0;
+}
+
+pending_t *pool_get()
+{
+  pthread_mutex_lock(&pool_lock);
+  while (pool_free == 0)
+    pthread_cond_wait(&pool_nonempty, &pool_lock);
+  pending_t *req = pool[--pool_free];
+  pthread_mutex_unlock(&pool_lock);
+  return req;
+}
+
+int pool_put(pending_t *req)
+{
+  pthread_mutex_lock(&pool_lock);
+  pool[pool_free++] = req;
+  pthread_cond_signal(&pool_nonempty);
+  pthread_mutex_unlock(&pool_lock);
+  return 0;
+}
+
+void *reader_main(void *arg)
+{
+  int sd = *(int*)arg;
+  MFS_MSG_t *msg_rc = (MFS_MSG_t*)malloc(sizeof(MFS_MSG_t));
+  msg_rc->blocks = (char*)malloc(MFS_RANGE_MAX * MFS_BLOCK_SIZE);
+  while (1)
+  {
+    pending_t *req = reqq_pop(&read_q, -1);
+    request_type(sd, &req->sock, &req->msg, msg_rc);
+    pool_put(req);
+    __atomic_add_fetch(&reads_served, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+// gather the datagrams of a WRITEV range; returns the slot once the range
+// is complete, its blocks then belong to the caller. An unfinished range is
+// dropped when its slot is needed, the client retransmits all of it.
+rasm_t *rasm_add(struct sockaddr_in *sock, MFS_MSG_t *msg, int part)
+{
+  rasm_t *r = NULL, *lru = &rasm[0];
+  for (int i = 0; i < RASM_SLOTS && r == NULL; i++)
+  {
+    if (rasm[i].seq == msg->seq && rasm[i].sock.sin_port == sock->sin_port &&
+        rasm[i].sock.sin_addr.s_addr == sock->sin_addr.s_addr)
+      r = &rasm[i];
+    else if (lru->seq != -1 && (rasm[i].seq == -1 || rasm[i].used < lru->used))
+      lru = &rasm[i];
+  }
+  if (r != NULL && (r->inum != msg->inum || r->first != msg->block || r->count != msg->count))
+    r->seq = -1; // not the range it claims to belong to, start over
+  if (r == NULL || r->seq == -1)
+  {
+    if (r == NULL)
+      r = lru;
+    free(r->blocks);
+    r->sock = *sock;
+    r->seq = msg->seq;
+    r->inum = msg->inum;
+    r->first = msg->block;
+    r->count = msg->count;
+    r->got = 0;
+    r->blocks = (char*)malloc(msg->count * MFS_BLOCK_SIZE);
+  }
+  r->used = ++rasm_clock;
+  memcpy(r->blocks + part * MFS_BLOCK_SIZE, msg->data, MFS_BLOCK_SIZE);
+  r->got |= 1u << part;
+  if (r->got != ~0u >> (32 - r->count))
+    return NULL;
+  return r;
+}
+
+// reads a burst into pooled requests; those that are queued are replaced
+// before the next one, the rest are read into again
+void *receiver_main(void *arg)
+{
+  int sd = *(int*)arg;
+  pending_t *slots[UDP_BURST];
+  char *wires[UDP_BURST];
+  struct sockaddr_in socks[UDP_BURST];
+  int lens[UDP_BURST];
+  for (int i = 0; i < UDP_BURST; i++)
+    slots[i] = NULL;
+  while (1)
+  {
+    for (int i = 0; i < UDP_BURST; i++)
+    {
+      if (slots[i] == NULL)
+        slots[i] = pool_get();
+      wires[i] = slots[i]->wire;
+    }
+    int n = UDP_ReadBurstV(sd, socks, wires, MFS_WIRE_MAX, lens, UDP_BURST);
+    for (int i = 0; i < n; i++)
+    {
+      pending_t *req = slots[i];
+      int part = lens[i] < 1 ? -1 : msg_decode(req->wire, lens[i], &req->msg);
+      if (part == -1)
+        continue;
+      req->sock = socks[i];
+      if (req->msg.req == WRITEV)
+      {
+        rasm_t *r = rasm_add(&req->sock, &req->msg, part);
+        if (r == NULL)
+          continue;
+        req->msg.blocks = r->blocks; // the writer frees them
+        r->blocks = NULL;
+        r->seq = -1;
+      }
+      slots[i] = NULL;
+      reqq_push(request_readonly(req->msg.req) ? &read_q : &write_q, req);
+    }
+  }
+  return NULL;
+}
+
+// roll forward from the checkpoint: follow the unit chain from cr->end while
+// headers and checksums hold up, applying imap changes at each commit. A torn
+// or stale unit ends the log, along with the uncommitted units before it.
+// Replaying the commit of inode_upgrade upgrades the image.
+int lfs_recover()
+{
+  long start = now_usec();
+  int pieces = INODE_LIMIT / IMAP_ENTRIES;
+  int imap_new[INODE_LIMIT / IMAP_ENTRIES];
+  char touched[INODE_LIMIT / IMAP_ENTRIES];
+  memset(touched, 0, sizeof(touched));
+  int upgraded = 0;
+
+  int pos = cr->end, seq = cr->seq, first_seq = cr->seq;
+  long bytes = 0, replayed = 0;
+  char *body = NULL;
+  int cap = 0;
+  MFS_Sum_t sum;
+  while (unit_load(pos, seq, &sum, &body, &cap) == 0)
+  {
+    int len = sum.nbytes + sum.nentries * sizeof(MFS_SumEnt_t);
+
+    MFS_SumEnt_t *ents = (MFS_SumEnt_t*)(body + sum.nbytes);
+    int addr = pos + sizeof(MFS_Sum_t);
+    for (int i = 0; i < sum.nentries; i++)
+    {
+      int id = ents[i].id;
+      if ((ents[i].type == SUM_IMAP || ents[i].type == SUM_IMAP_DROP) && id >= 0 && id < pieces)
+      {
+        imap_new[id] = ents[i].type == SUM_IMAP ? addr : -1;
+        touched[id] = 1;
+      }
+      if (ents[i].type == SUM_INODE && ents[i].len == sizeof(MFS_Inode_t))
+        upgraded = 1;
+      addr += ents[i].len;
+    }
+    bytes += sizeof(MFS_Sum_t) + len;
+
+    if (sum.flags & SUM_COMMIT)
+    {
+      for (int i = 0; i < pieces; i++)
+      {
+        if (touched[i])
+          cr->imap[i] = imap_new[i];
+      }
+      memset(touched, 0, sizeof(touched));
+      if (upgraded)
+        inode_v1 = 0;
+      cr->end = sum.next;
+      cr->seq = seq + 1;
+      replayed = bytes;
+    }
+    pos = sum.next;
+    seq++;
+  }
+  free(body);
+
+  fprintf(stderr, "recovery: checkpoint %d from slot %d, rolled forward %d log units (%ld bytes) in %ld ms\n",
+      cr->gen, cr_slot, cr->seq - first_seq, replayed, (now_usec() - start) / 1000);
+  return 0;
+}
+
+// a CR slot is good if its checksum over len bytes holds and the units it
+// was written together with made it to the image
+int cr_valid(MFS_CR_t *c, int len)
+{
+  if (c->magic != MFS_CR_MAGIC && c->magic != MFS_CR_MAGIC_V2 && c->magic != MFS_CR_MAGIC_V1)
+    return 0;
+  if (log_checksum((char*)c, len) != c->checksum)
+    return 0;
+  if (c->seg_size != 0 && (c->seg_size < 4 * MFS_BLOCK_SIZE || c->seg_size > MFS_SEG_MAX))
     return 0;
+
+  char *body = NULL;
+  int cap = 0;
+  int pos = c->verify_from, seq = c->verify_seq;
+  MFS_Sum_t sum;
+  while (seq < c->seq && unit_load(pos, seq, &sum, &body, &cap) == 0)
+  {
+    pos = sum.next;
+    seq++;
+  }
+  free(body);
+  return pos == c->end && seq == c->seq;
+}
+
+// load the newest good CR slot, -1 when there is none. Failing that, look
+// for the shorter slots of images from before the CR kept seg_size; those
+// set cr_v3 and come back with cr->seg_size 0.
+int cr_load()
+{
+  MFS_CR_t *c = (MFS_CR_t*)malloc(sizeof(MFS_CR_t));
+  int best = -1;
+  for (int v3 = 0; v3 <= 1 && best == -1; v3++)
+  {
+    int size = v3 ? MFS_CR_V3_SIZE : sizeof(MFS_CR_t);
+    for (int i = 0; i < MFS_CR_SLOTS; i++)
+    {
+      if (io_read(c, size, i * size) == -1)
+        continue;
+      int len = offsetof(MFS_CR_t, checksum);
+      if (v3)
+      {
+        c->checksum = c->seg_size; // it sat where seg_size is now
+        c->seg_size = 0;
+        len = offsetof(MFS_CR_t, seg_size);
+      }
+      else if (c->seg_size == 0)
+        continue;
+      if (!cr_valid(c, len) || (best != -1 && c->gen <= cr->gen))
+        continue;
+      memcpy(cr, c, sizeof(MFS_CR_t));
+      best = i;
+      cr_v3 = v3;
+    }
+  }
+  free(c);
+  return best;
 }
 
 int lfs_init(int port, char* image_path)
@@ -921,8 +3309,16 @@ int lfs_init(int port, char* image_path)
     // perror("init: Cannot open file");
   }
 
+  io_init();
   cr = (MFS_CR_t*)malloc(sizeof(MFS_CR_t));
-  
+  inode_map = (int*)malloc(sizeof(int) * INODE_LIMIT);
+  snap_map = (int*)malloc(sizeof(int) * INODE_LIMIT);
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&snap_lock, &attr);
+  icache_init();
+  inode_defer_init();
 
   if (f_stat.st_size < sizeof(MFS_CR_t))
   {
@@ -932,10 +3328,15 @@ int lfs_init(int port, char* image_path)
 
     for (int i = 0; i < INODE_LIMIT / IMAP_ENTRIES; i++)
       cr->imap[i] = -1;
-		cr->end = sizeof(MFS_CR_t);
-
-    lseek(fd, 0, SEEK_SET);
-    write(fd, cr, sizeof(MFS_CR_t));
+		cr->end = seg_start(0);
+    cr->magic = MFS_CR_MAGIC;
+    cr->seq = log_seq;
+    cr->gen = 0;
+    cr->seg_size = seg_size;
+    imap_load();
+    seg_usage_rebuild(0);
+    seg_init();
+    log_synced();
 
     MFS_Dir_t db;
 		for (int i = 2; i < DIR_ENTRIES; i++)
@@ -950,51 +3351,100 @@ int lfs_init(int port, char* image_path)
     {
       db.entries[i].inum = -1;
     }
-    
-
-		int cr_offset = cr->end;
-    cr->end += MFS_BLOCK_SIZE;
-    lseek(fd, cr_offset, SEEK_SET);
-    write(fd, &db, sizeof(MFS_Dir_t));
-
 
     MFS_Inode_t ind;
     MFS_Inode_t *ind_ptr = &ind;
-    ind.size = 0;
+    ind.size = MFS_BLOCK_SIZE;
     ind.type = MFS_DIRECTORY;
 		create_empty_inode(ind_ptr);
-    ind.ptrs[0] = cr_offset;
-
-		int nd_offset = 0;
-    nd_offset = cr->end;
-    cr->end += sizeof(MFS_Inode_t);
-    lseek(fd, nd_offset, SEEK_SET);
-    write(fd, &ind, sizeof(MFS_Inode_t));
+    MFS_Extent_t first = {0, log_append(&db, sizeof(MFS_Dir_t), SUM_DIR, 0), 1};
+    ind.ext[0] = first;
+    ind.nextents = 1;
 
-
-    MFS_Imap_t imp;
-    MFS_Imap_t* imp_ptr = &imp;
-		create_empty_imap(imp_ptr);
-    imp.inode_addr[0] = nd_offset;
-
-		int mp_offset = 0;
-    mp_offset = cr->end;
-    cr->end += sizeof(MFS_Imap_t);
-    lseek(fd, mp_offset, SEEK_SET);
-    write(fd, &imp, sizeof(MFS_Imap_t));
-
-    cr->imap[0] = mp_offset; 
-    lseek(fd, 0, SEEK_SET);
-    write(fd, cr, sizeof(MFS_CR_t));
-
-    fsync(fd);
+    inode_write(0, &ind);
+    imap_flush_piece(0);
+    lfs_checkpoint();
   }
   else
   {
-    lseek(fd, 0, SEEK_SET);
-    read(fd, cr, sizeof(MFS_CR_t));
+    int legacy = 0;
+    cr_slot = cr_load();
+    if (cr_slot == -1)
+    {
+      io_read(cr, sizeof(MFS_CR_t), 0);
+      if (cr->magic == MFS_CR_MAGIC || cr->magic == MFS_CR_MAGIC_V2 || cr->magic == MFS_CR_MAGIC_V1)
+      {
+        // perror("init: no valid checkpoint");
+        return -1;
+      }
+      // an image from before the CR slots, its single CR ends at the imap
+      legacy = 1;
+      inode_v1 = 1;
+      dir_v1 = 1;
+      cr_slot = MFS_CR_SLOTS - 1;
+      cr->seq = 1;
+      cr->gen = 0;
+    }
+    else
+    {
+      inode_v1 = cr->magic == MFS_CR_MAGIC_V1;
+      dir_v1 = cr->magic != MFS_CR_MAGIC;
+      lfs_recover();
+    }
+
+    // segments keep the size the image was made with, older images did not
+    // record it and can only go by -s
+    if (legacy || cr_v3)
+      cr->seg_size = seg_size;
+    else if (cr->seg_size != seg_size)
+    {
+      fprintf(stderr, "recovery: the image has %d byte segments, ignoring -s %d\n", cr->seg_size, seg_size);
+      seg_size = cr->seg_size;
+    }
+    log_seq = cr->seq;
+    imap_load();
+    seg_usage_rebuild(f_stat.st_size);
+    seg_init();
+    log_synced();
+
+    // the old CR was shorter, move whatever sits where the slots now are
+    // before they are written over
+    if (legacy)
+    {
+      inode_upgrade();
+      dir_upgrade();
+      clean_range(MFS_CR_LEGACY_SIZE, seg_start(0));
+    }
+
+    // otherwise nothing may be appended before the recovered state is
+    // checkpointed, the new segment can be one the old chain runs through
+    lfs_checkpoint();
+
+    // the longer slots run 8 bytes into where segment 0 started: move what
+    // lives there and checkpoint into the old slot 0, so a torn first write
+    // of the new slot 1 leaves that one to recover from
+    if (cr_v3)
+    {
+      clean_range(MFS_CR_SLOTS * MFS_CR_V3_SIZE, seg_start(0));
+      do
+        lfs_checkpoint();
+      while (cr_slot != 0 && !io_failed);
+      cr_v3 = 0;
+      lfs_checkpoint();
+    }
+    if (inode_v1)
+    {
+      inode_upgrade();
+      lfs_checkpoint();
+    }
+    if (dir_v1)
+    {
+      dir_upgrade();
+      lfs_checkpoint();
+    }
   }
 
+  io_map_init();
 
   int sd = UDP_Open(port);
   if (sd < 0)
@@ -1002,25 +3452,135 @@ int lfs_init(int port, char* image_path)
     // perror("Port occupied");
     return -1;
   }
-
-  struct sockaddr_in sock;
-  MFS_MSG_t msg_sd;
-  MFS_MSG_t msg_rc;
-
+  UDP_SetRcvBuf(sd, RASM_RCVBUF);
+
+  MFS_MSG_t *msg_rc = (MFS_MSG_t*)malloc(sizeof(MFS_MSG_t));
+
+  pending = (pending_t*)malloc(sizeof(pending_t) * commit_batch);
+  drc_init();
+  lease_init();
+  ra_init();
+  pool_init();
+  for (int i = 0; i < RASM_SLOTS; i++)
+    rasm[i].seq = -1;
+  reqq_init(&read_q);
+  reqq_init(&write_q);
+  pthread_t tid;
+  for (int i = 0; i < reader_threads; i++)
+    pthread_create(&tid, NULL, reader_main, &sd);
+  pthread_create(&tid, NULL, receiver_main, &sd);
+
+  // this thread is the writer
+  int idle_armed = 1; // clean and checkpoint once no updates come in
   while (1)
   {
-    if (UDP_Read(sd, &sock, (char*)&msg_sd, sizeof(MFS_MSG_t)) < 1)
+    long timeout = -1;
+    long held_next = held_flush(sd);
+    if (pending_cnt > 0)
+    {
+      timeout = batch_deadline - now_usec();
+      if (timeout <= 0)
+      {
+        batch_flush(sd);
+        continue;
+      }
+    }
+    else if (idle_armed)
+      timeout = clean_idle_ms * 1000L;
+    if (held_next >= 0 && (timeout < 0 || held_next < timeout))
+      timeout = held_next;
+
+    pending_t *req = reqq_pop(&write_q, timeout);
+    if (req == NULL)
+    {
+      if (pending_cnt > 0)
+      {
+        batch_flush(sd);
+        continue;
+      }
+      if (held_cnt > 0)
+        continue;
+      int cleaned = cleaner_run(1);
+      if (checkpoint_due())
+        lfs_checkpoint();
+      if (cleaned == 0 && log_bytes == ckpt_log_mark)
+        idle_armed = 0;
       continue;
-    request_type(sd, sock, msg_sd, msg_rc);
+    }
+    request_type(sd, &req->sock, &req->msg, msg_rc);
+    if (req->msg.req == WRITEV)
+      free(req->msg.blocks);
+    pool_put(req);
+    idle_armed = 1;
   }
   return 0;
 }
 
 int main(int argc, char*argv[]) {
-  if (argc != 3)
+  int opt;
+  while ((opt = getopt(argc, argv, "i:w:b:s:u:t:C:M:I:T:r:L:A:m")) != -1)
+  {
+    switch (opt)
+    {
+      case 'i':
+        icache_size = atoi(optarg);
+        break;
+      case 'w':
+        commit_window = atoi(optarg);
+        break;
+      case 'b':
+        commit_batch = atoi(optarg);
+        if (commit_batch < 1)
+          commit_batch = 1;
+        break;
+      case 's':
+        seg_size = atoi(optarg);
+        if (seg_size < 4 * MFS_BLOCK_SIZE)
+          seg_size = 4 * MFS_BLOCK_SIZE;
+        if (seg_size > MFS_SEG_MAX)
+          seg_size = MFS_SEG_MAX;
+        break;
+      case 'u':
+        clean_max_util = atoi(optarg);
+        break;
+      case 't':
+        clean_idle_ms = atoi(optarg);
+        break;
+      case 'C':
+        ckpt_interval = atoi(optarg);
+        break;
+      case 'M':
+        ckpt_log_mb = atoi(optarg);
+        break;
+      case 'I':
+        io_backend = strcmp(optarg, "uring") == 0 ? IO_URING : IO_PSYNC;
+        break;
+      case 'r':
+        drc_size = atoi(optarg);
+        break;
+      case 'L':
+        lease_usec = atoi(optarg);
+        break;
+      case 'A':
+        ra_window = atoi(optarg);
+        break;
+      case 'm':
+        io_mmap = 1;
+        break;
+      case 'T':
+        reader_threads = atoi(optarg);
+        if (reader_threads < 1)
+          reader_threads = 1;
+        break;
+      default:
+        // perror("Usage: server <portnum> <image> [-i inode_cache_entries] [-w commit_window_usec] [-b commit_batch] [-s segment_bytes] [-u clean_max_live_pct] [-t clean_idle_ms] [-C checkpoint_secs] [-M checkpoint_log_mb] [-I psync|uring] [-T reader_threads] [-r dup_cache_entries] [-L lease_usec] [-A readahead_blocks] [-m]\n");
+        exit(1);
+    }
+  }
+  if (argc - optind != 2)
   {
-    // perror("Usage: server <portnum> <image>\n");
+    // perror("Usage: server <portnum> <image> [-i inode_cache_entries] [-w commit_window_usec] [-b commit_batch] [-s segment_bytes] [-u clean_max_live_pct] [-t clean_idle_ms] [-C checkpoint_secs] [-M checkpoint_log_mb] [-I psync|uring] [-T reader_threads] [-r dup_cache_entries] [-L lease_usec] [-A readahead_blocks] [-m]\n");
     exit(1);
   }
-  lfs_init(atoi(argv[1]), argv[2]);
+  lfs_init(atoi(argv[optind]), argv[optind + 1]);
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 #define INODE_LIMIT (4096)
 #define IMAP_ENTRIES (16)
 #define DIR_ENTRIES (128)
-#define INODE_PTRS (14)
+#define INODE_PTRS (14) // blocks of an unhashed directory, block pointers in MFS_InodeV1_t
 
 enum REQUEST {
   INIT,
@@ -12,29 +12,128 @@ enum REQUEST {
   CREAT,
   UNLINK,
   RESPONSE,
-  SHUTDOWN
+  SHUTDOWN,
+  READV,  // a range of blocks of one inode
+  WRITEV,
+  LOOKUP_PATH // a path of names from a directory, resolved in one request
 };
 
-// checkpoint region
+#define MFS_CR_MAGIC (0x4c465346)
+#define MFS_CR_MAGIC_V2 (0x4c465345) // directories are not hashed
+#define MFS_CR_MAGIC_V1 (0x4c465344) // inodes are MFS_InodeV1_t, directories not hashed
+#define MFS_SUM_MAGIC (0x4c465355)
+
+// checkpoint region, written alternately to MFS_CR_SLOTS slots at the front
+// of the image; the valid one with the highest gen is current
 typedef struct __MFS_CR_t
 {
-	int end;
+	int end; // where the log continues after this checkpoint
 	int imap[INODE_LIMIT / IMAP_ENTRIES];
+	int magic; // MFS_CR_MAGIC, images from before the slots end at imap
+	int seq;   // sequence number of the log unit starting at end
+	int gen;   // checkpoint generation
+	int verify_from; // units from here to end were not fsynced before the CR,
+	int verify_seq;  // the slot is only good if they read back intact
+	int seg_size;    // segment bytes the log was written with
+	int checksum;    // over everything above
 } MFS_CR_t;
 
+#define MFS_CR_SLOTS (2)
+#define MFS_CR_LEGACY_SIZE (sizeof(int) * (1 + INODE_LIMIT / IMAP_ENTRIES))
+#define MFS_CR_V3_SIZE (offsetof(MFS_CR_t, seg_size) + sizeof(int)) // slots without seg_size
+#define MFS_SEG_MAX (64 << 20) // largest segment, and so the largest log unit
+
+// what a log item is, recorded in the summary of the unit holding it
+enum SUM_TYPE {
+  SUM_DATA,
+  SUM_DIR,
+  SUM_INODE,
+  SUM_IMAP,
+  SUM_IMAP_DROP, // no payload, the imap piece was removed from the CR
+  SUM_EXTENT     // an extent block or extent index of inode id
+};
+
+#define SUM_COMMIT (1) // the unit closes a commit, replay may stop after it
+
+// log unit header, followed by the items it describes and then one
+// MFS_SumEnt_t per item
+typedef struct __MFS_Sum_t
+{
+	int magic;
+	int seq;
+	int addr;     // log address of this header
+	int nbytes;   // item bytes between the header and the entry table
+	int nentries;
+	int next;     // log address of the next unit's header
+	int flags;
+	int checksum; // over the items and the entry table
+} MFS_Sum_t;
+
+typedef struct __MFS_SumEnt_t
+{
+	int type;
+	int id; // inode number, or imap piece for SUM_IMAP and SUM_IMAP_DROP
+	int len;
+} MFS_SumEnt_t;
+
+// a run of file blocks lying back to back in the log
+typedef struct __MFS_Extent_t
+{
+	int block; // first file block
+	int addr;  // log address of its data
+	int len;   // blocks
+} MFS_Extent_t;
+
+#define INODE_EXTENTS (14)
+#define INODE_SPANS (INODE_EXTENTS * sizeof(MFS_Extent_t) / sizeof(int))
+#define EXT_SPAN (256) // file blocks one extent block describes
+#define EXT_INDEX (MFS_BLOCK_SIZE / sizeof(int))
+#define MFS_FILE_BLOCKS ((INODE_SPANS + EXT_INDEX) * EXT_SPAN)
+
+// a file's extents are sorted by block and live in the inode until there
+// are more than INODE_EXTENTS of them. From then on extent block k holds
+// those of blocks [k * EXT_SPAN, (k + 1) * EXT_SPAN); the inode keeps the
+// addresses of the first INODE_SPANS extent blocks in place of its
+// extents, an extent index those of the next EXT_INDEX.
 typedef struct __MFS_Inode_t
 {
 	int size;
 	int type;
-	int ptrs[INODE_PTRS];
+	int nextents; // extents in use in ext, -1 once they are in extent blocks
+	int index;    // log address of the extent index, -1 if there is none
+	union
+	{
+		MFS_Extent_t ext[INODE_EXTENTS];
+		int span[INODE_SPANS]; // -1 where no block of the span was written
+	};
 } MFS_Inode_t;
 
+typedef struct __MFS_ExtBlock_t
+{
+	int nextents;
+	MFS_Extent_t ext[EXT_SPAN];
+} MFS_ExtBlock_t;
+
+typedef struct __MFS_ExtIndex_t
+{
+	int span[EXT_INDEX]; // for spans INODE_SPANS on
+} MFS_ExtIndex_t;
+
+// inode of images with MFS_CR_MAGIC_V1 or older, upgraded when loaded
+typedef struct __MFS_InodeV1_t
+{
+	int size;
+	int type;
+	int ptrs[INODE_PTRS];
+} MFS_InodeV1_t;
+
 // one imap scratch
 typedef struct __MFS_Imap_t
 {
 	int inode_addr[IMAP_ENTRIES];
 } MFS_Imap_t;
 
+// a directory block, or bucket of a hashed directory
 typedef struct __MFS_Dir_t
 {
 	MFS_DirEnt_t entries[DIR_ENTRIES];
@@ -50,4 +149,53 @@ typedef struct __MFS_Msg_t
 	int inum;
 	int block;
 	MFS_Stat_t stat;
-} MFS_MSG_t;
\ No newline at end of file
+	int seq; // request sequence number, echoed in the reply
+	int count;    // READV and WRITEV: blocks in the range starting at block
+	char *blocks; // and their data, count * MFS_BLOCK_SIZE bytes
+	int lease; // READ and READV: usec of lease asked for, or granted in a reply
+	char *data; // a block held outside buffer: a WRITE's in the datagram or the
+	            // caller's memory, a READ reply's in the image mapping or the caller's
+} MFS_MSG_t;
+
+// wire format: MFS_MSG_t only lives in memory, on the network each message
+// is a header and a payload sized to what the message carries. Requests
+// with a name carry its bytes (no terminator), LOOKUP_PATH requests their
+// path the same way, WRITE requests and READ replies a block, STAT and
+// LOOKUP_PATH replies an MFS_Stat_t; everything else is the header alone.
+// A READ request may carry an int, the usec of lease its client would like
+// on the block; arg of the reply is the lease granted, 0 for none. A READV
+// request may carry the same int after its range, each datagram of the
+// reply then carries the lease granted after its block. arg of a successful
+// UNLINK reply is the inode the name was removed from, -1 if there was no
+// such name and 0 if the server does not say.
+//
+// A range of blocks travels as a burst of datagrams, one per block:
+// WRITEV requests and READV replies carry an MFS_WireRange_t naming the
+// whole range and then the block at arg. A READV request is a single
+// datagram carrying the range, a WRITEV range gets a single plain reply
+// once all of it has been written.
+#define MFS_WIRE_MAGIC (0x4d46)
+#define MFS_WIRE_VERSION (1)
+
+typedef struct __MFS_WireHdr_t
+{
+	unsigned short magic;  // MFS_WIRE_MAGIC
+	unsigned char version; // MFS_WIRE_VERSION
+	unsigned char req;     // enum REQUEST, RESPONSE in replies
+	int seq;
+	int inum; // inode the request is about, the result in a reply
+	int arg;  // block for READ and WRITE, file type for CREAT, lease in a READ reply,
+	          // the inode removed in an UNLINK reply
+	int len;  // payload bytes following the header
+} MFS_WireHdr_t;
+
+typedef struct __MFS_WireRange_t
+{
+	int first; // first block of the range
+	int count; // blocks in it, 1 to MFS_RANGE_MAX
+} MFS_WireRange_t;
+
+#define MFS_RANGE_MAX (32)
+#define MFS_PATH_MAX (MFS_BLOCK_SIZE - 1) // path bytes a LOOKUP_PATH carries in buffer
+
+#define MFS_WIRE_MAX (sizeof(MFS_WireHdr_t) + sizeof(MFS_WireRange_t) + MFS_BLOCK_SIZE + sizeof(int))
\ No newline at end of file
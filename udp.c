@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg
 #include "udp.h"
 
 // create a socket and bind it to a port on the current machine
@@ -26,6 +27,11 @@ int UDP_Open(int port) {
 	return fd;
 }
 
+// ask for room to queue a burst of datagrams, the kernel may grant less
+int UDP_SetRcvBuf(int fd, int bytes) {
+	return setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
 // fill sockaddr_in struct with proper goodies
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
 	bzero(addr, sizeof(struct sockaddr_in));
@@ -61,6 +67,75 @@ int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
 	return rc;
 }
 
+// receive up to n datagrams of at most len bytes, datagram i into
+// buffer + i * len with its length in lens[i] and sender in addrs[i]. Waits
+// for the first one only, returns how many were taken
+int UDP_ReadBurst(int fd, struct sockaddr_in *addrs, char *buffer, int len, int *lens, int n) {
+	struct mmsghdr msgs[UDP_BURST];
+	struct iovec iov[UDP_BURST];
+	if (n > UDP_BURST)
+		n = UDP_BURST;
+	bzero(msgs, sizeof(struct mmsghdr) * n);
+	for (int i = 0; i < n; i++) {
+		iov[i].iov_base = buffer + i * len;
+		iov[i].iov_len = len;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int rc = recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+	for (int i = 0; i < rc; i++)
+		lens[i] = msgs[i].msg_len;
+	return rc;
+}
+
+// like UDP_ReadBurst, datagram i going to buffers[i]
+int UDP_ReadBurstV(int fd, struct sockaddr_in *addrs, char **buffers, int len, int *lens, int n) {
+	struct mmsghdr msgs[UDP_BURST];
+	struct iovec iov[UDP_BURST];
+	if (n > UDP_BURST)
+		n = UDP_BURST;
+	bzero(msgs, sizeof(struct mmsghdr) * n);
+	for (int i = 0; i < n; i++) {
+		iov[i].iov_base = buffers[i];
+		iov[i].iov_len = len;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	int rc = recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+	for (int i = 0; i < rc; i++)
+		lens[i] = msgs[i].msg_len;
+	return rc;
+}
+
+// send n datagrams to addr, datagram i gathered from the iovcnt iovecs at
+// iov + i * iovcnt. Returns how many went out
+int UDP_WriteBurst(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt, int n) {
+	struct mmsghdr msgs[UDP_BURST];
+	int sent = 0;
+	while (sent < n) {
+		int batch = n - sent < UDP_BURST ? n - sent : UDP_BURST;
+		bzero(msgs, sizeof(struct mmsghdr) * batch);
+		for (int i = 0; i < batch; i++) {
+			msgs[i].msg_hdr.msg_name = addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			msgs[i].msg_hdr.msg_iov = iov + (sent + i) * iovcnt;
+			msgs[i].msg_hdr.msg_iovlen = iovcnt;
+		}
+		int rc = sendmmsg(fd, msgs, batch, 0);
+		if (rc <= 0) {
+			if (rc < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		sent += rc;
+	}
+	return sent;
+}
+
 int UDP_Close(int fd) {
   return close(fd);
 }
\ No newline at end of file
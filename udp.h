@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netinet/tcp.h>
 #include <netinet/in.h>
@@ -29,10 +30,18 @@
 
 int UDP_Open(int port);
 int UDP_Close(int fd);
+int UDP_SetRcvBuf(int fd, int bytes);
 
 int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
 int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
 
+// bursts of datagrams in as few system calls as sendmmsg/recvmmsg allow
+#define UDP_BURST (64)
+
+int UDP_ReadBurst(int fd, struct sockaddr_in *addrs, char *buffer, int len, int *lens, int n);
+int UDP_ReadBurstV(int fd, struct sockaddr_in *addrs, char **buffers, int len, int *lens, int n);
+int UDP_WriteBurst(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt, int n);
+
 int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port);
 
 #endif // __UDP_h__
\ No newline at end of file